@@ -105,7 +105,6 @@ public:
         va_end(ap);
     }
     void IllustrateNote(int adlchn, int note, int ins, int pressure, double bend) {}
-    void IllustrateVolumes(double left, double right) {}
     void IllustratePatchChange(int MidCh, int patch, int adlinsid) {}
 private:
     const AdlMidiPlugin::Features &m_features;
@@ -179,18 +178,13 @@ void AdlMidiPlugin::activate()
 
 static inline void write_samples(MIDIeventhandler *evh, float *out[2], uint32_t offset, uint32_t count)
 {
-    float outbuf[MaxSamplesAtTime*2];
+    // Update adds in samples, so initialize to zero
+    memset(out[0] + offset, 0, count*sizeof(float));
+    memset(out[1] + offset, 0, count*sizeof(float));
     while (count > 0) // Some of the underlying synths are limited to 512 samples at a time
     {
         uint32_t n_samples = std::min(count, MaxSamplesAtTime);
-        // Update adds in samples, so initialize to zero
-        memset(outbuf, 0, n_samples*2*sizeof(float));
-        evh->Update(outbuf, n_samples);
-        for(unsigned a = 0; a < n_samples; ++a)
-        {
-            out[0][offset + a] = outbuf[a*2+0];
-            out[1][offset + a] = outbuf[a*2+1];
-        }
+        evh->UpdatePlanar(out[0] + offset, out[1] + offset, n_samples);
         count -= n_samples;
         offset += n_samples;
     }
@@ -1,107 +1,115 @@
 #include "audioout.hh"
 
 #include "adldata.hh"
+#include "audiotap.hh"
+#include "callbackmonitor.hh"
 #include "config.hh"
+#include "ringbuffer.hh"
+#include "sync.hh"
 #include "ui.hh"
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <deque>  // deque
 #include <map>
 #include <set>
 #include <stdarg.h>
 #include <string>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 
 #ifdef AUDIO_JACK
-#include <jack/jack.h>
-#include <jack/midiport.h>
+#include "jackmidi.hh"
 #endif
 
-// Comment this out to disable reverb and other postprocessing of the audio
-// #define USE_REVERB
-// Frequency of volume updates in UI
-#define VOLUME_UPDATE_FREQ 24
-
 class AudioPostprocessor;
+class RenderAhead;
 static AudioGenerator *audio_gen;
 static AudioPostprocessor *audio_postprocessor;
+static AudioTap *audio_tap;
+static UIInterface *tap_ui;
+static RenderAhead *render_ahead;
 static MIDIReceiver *midi_if;
 static unsigned int pcm_rate;
+static CallbackMonitor callback_monitor;
+static void RequestSamplesS16(unsigned long count, short *samples);
 
 AudioGenerator::~AudioGenerator()
 {
 }
 
-MIDIReceiver::~MIDIReceiver()
+void AudioGenerator::RequestSamplesPlanar(unsigned long count, float* left, float* right)
 {
+    float in[MaxSamplesAtTime*2]; /* need temporary buffer for interleaved samples */
+    for(unsigned long done = 0; done < count; )
+    {
+        unsigned long n = std::min(count - done, (unsigned long)MaxSamplesAtTime);
+        RequestSamples(n, in);
+        for(unsigned long a = 0; a < n; ++a)
+        {
+            left[done+a] = in[a*2+0];
+            right[done+a] = in[a*2+1];
+        }
+        done += n;
+    }
 }
 
-
-inline short short_sample_from_float(float in)
+MIDIReceiver::~MIDIReceiver()
 {
-    const float out = in * 32767.0;
-    return out<-32768 ? -32768 : (out>32767 ?  32767 : out);
 }
 
+
 #ifdef AUDIO_SDL
 static SDL_AudioSpec obtained;
 static void SDL_AudioCallback(void*, Uint8* stream, int len)
 {
+    uint64_t start = callback_monitor.Begin();
     short* target = (short*) stream;
     unsigned nframes = len/(2*sizeof(short));
-    unsigned bufsize = nframes*2;
-    float in[bufsize]; /* need temporary buffer for interleaved samples */
-    if(audio_gen)
-        audio_gen->RequestSamples(nframes, in);
-    for(unsigned a = 0; a < bufsize; ++a)
-        target[a] = short_sample_from_float(in[a]);
+    RequestSamplesS16(nframes, target);
+    callback_monitor.End(start, nframes, pcm_rate);
 }
 #endif // AUDIO_SDL
 
 #ifdef AUDIO_JACK
 jack_port_t *output_port[2];
-#define NUM_MIDI_PORTS 1
-jack_port_t *midi_port[NUM_MIDI_PORTS];
+jack_port_t *midi_port[MaxMIDIPorts];
 jack_client_t *client;
 // JACK audio callback
 static int JACK_AudioCallback(jack_nframes_t nframes, void *)
 {
+    uint64_t start = callback_monitor.Begin();
     float *out[2] = {(jack_default_audio_sample_t *) jack_port_get_buffer(output_port[0], nframes),
                      (jack_default_audio_sample_t *) jack_port_get_buffer(output_port[1], nframes)};
 
     if(midi_if)
     {
-        // Process MIDI input
-        for(int port=0; port<NUM_MIDI_PORTS; ++port)
-        {
-            void *port_buf = jack_port_get_buffer(midi_port[port], nframes);
-            jack_nframes_t event_count = jack_midi_get_event_count(port_buf);
-            for(jack_nframes_t idx=0; idx<event_count; ++idx)
-            {
-                jack_midi_event_t in_event;
-                jack_midi_event_get(&in_event, port_buf, idx);
-                midi_if->PushEvent(in_event.time, port, in_event.buffer, in_event.size);
-            }
-        }
+        // Process MIDI input from all ports, in timestamp order
+        JackMIDIMerge events(midi_port, NumMIDIPorts, nframes);
+        jack_midi_event_t in_event;
+        unsigned port;
+        while(events.Next(&in_event, &port))
+            midi_if->PushEvent(in_event.time, port, in_event.buffer, in_event.size);
     }
 
     if(audio_gen)
     {
-        unsigned bufsize = nframes*2;
-        float in[bufsize]; /* need temporary buffer for interleaved samples */
-        audio_gen->RequestSamples(nframes, in);
-
-        for(unsigned a = 0; a < bufsize; ++a)
-            out[a&1][a>>1] = in[a];
+        audio_gen->RequestSamplesPlanar(nframes, out[0], out[1]);
     } else {
         memset(out[0], 0, nframes*sizeof(float));
         memset(out[1], 0, nframes*sizeof(float));
     }
+    callback_monitor.End(start, nframes, pcm_rate);
+    return 0;
+}
+static int JACK_XrunCallback(void *)
+{
+    callback_monitor.CountXrun();
     return 0;
 }
 static void JACK_ShutdownCallback(void *)
@@ -136,7 +144,7 @@ unsigned long upper_power_of_two(unsigned long v)
     return v;
 }
 
-void InitializeAudio(double AudioBufferLength, unsigned int *sample_rate)
+static void InitializeDevice(double AudioBufferLength, unsigned int *sample_rate)
 {
 #ifdef AUDIO_SDL
     // Set up SDL
@@ -176,6 +184,7 @@ void InitializeAudio(double AudioBufferLength, unsigned int *sample_rate)
         InitMessage(-1, "unique name `%s' assigned\n", jack_get_client_name(client));
     }
     jack_set_process_callback(client, JACK_AudioCallback, 0);
+    jack_set_xrun_callback(client, JACK_XrunCallback, 0);
     jack_on_shutdown(client, JACK_ShutdownCallback, 0);
 
     pcm_rate = (unsigned int)jack_get_sample_rate(client);
@@ -216,251 +225,664 @@ void InitializeAudio(double AudioBufferLength, unsigned int *sample_rate)
         *sample_rate = pcm_rate;
 }
 
-/** Wrap audio_gen to provide
- *  - volume visualization
- *  - reverb
- *  - final volume scaling
+static void ShutdownDevice()
+{
+#ifdef AUDIO_SDL
+    SDL_CloseAudio();
+#endif
+#ifdef AUDIO_JACK
+    jack_deactivate(client);
+    for(int port=0; port<2; ++port)
+        jack_port_unregister(client, output_port[port]);
+    if (midi_if)
+    {
+        for(unsigned port=0; port<NumMIDIPorts; ++port)
+            jack_port_unregister(client, midi_port[port]);
+    }
+    jack_client_close(client);
+#endif
+}
+
+// Null and WAV file output, driven by a timer thread instead of a device
+static SDL_Thread *timer_thread;
+static std::atomic<bool> timer_running;
+static unsigned timer_frames;     // Frames per callback
+static std::vector<float> timer_buffer;
+static std::vector<short> wav_buffer;
+static FILE *wav_file;
+static unsigned long wav_frames;  // Frames written to wav_file so far
+
+static bool OpenWAV(const char *filename)
+{
+    wav_file = std::fopen(filename, "wb");
+    if(!wav_file)
+        return false;
+    // 16-bit stereo PCM; the sizes are filled in by CloseWAV
+    std::fwrite("RIFF", 1, 4, wav_file);
+    std::fwrite(FourChars(0u).ret, 1, 4, wav_file);
+    std::fwrite("WAVEfmt ", 1, 8, wav_file);
+    std::fwrite(FourChars(16u).ret, 1, 4, wav_file);
+    std::fwrite(FourChars(1u | 2u << 16).ret, 1, 4, wav_file);  // PCM, 2 channels
+    std::fwrite(FourChars(pcm_rate).ret, 1, 4, wav_file);
+    std::fwrite(FourChars(pcm_rate * 4).ret, 1, 4, wav_file);   // Bytes per second
+    std::fwrite(FourChars(4u | 16u << 16).ret, 1, 4, wav_file); // Frame size, bits per sample
+    std::fwrite("data", 1, 4, wav_file);
+    std::fwrite(FourChars(0u).ret, 1, 4, wav_file);
+    wav_frames = 0;
+    return true;
+}
+
+static void CloseWAV()
+{
+    if(!wav_file)
+        return;
+    unsigned data_size = wav_frames * 4;
+    std::fseek(wav_file, 4, SEEK_SET);
+    std::fwrite(FourChars(data_size + 36).ret, 1, 4, wav_file);
+    std::fseek(wav_file, 40, SEEK_SET);
+    std::fwrite(FourChars(data_size).ret, 1, 4, wav_file);
+    std::fclose(wav_file);
+    wav_file = 0;
+}
+
+static void Timer_AudioCallback()
+{
+    uint64_t start = callback_monitor.Begin();
+    if(wav_file)
+    {
+        short *out = &wav_buffer[0];
+        RequestSamplesS16(timer_frames, out);
+        wav_frames += std::fwrite(out, 4, timer_frames, wav_file);
+    }
+    else if(audio_gen)
+        audio_gen->RequestSamples(timer_frames, &timer_buffer[0]);
+    callback_monitor.End(start, timer_frames, pcm_rate);
+}
+
+static int TimerThread(void *)
+{
+    const long period_ns = timer_frames * 1000000000.0 / pcm_rate;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while(timer_running && !(audio_gen && audio_gen->Finished()))
+    {
+        Timer_AudioCallback();
+        if(FreeRunAudio)
+            continue;
+        // Absolute deadlines, so that the time spent rendering does not add up
+        next.tv_nsec += period_ns;
+        while(next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            ++next.tv_sec;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return 0;
+}
+
+void InitializeAudio(double AudioBufferLength, unsigned int *sample_rate)
+{
+    if(AudioOutput == AUDIOOUT_DEVICE)
+    {
+        InitializeDevice(AudioBufferLength, sample_rate);
+        return;
+    }
+    pcm_rate = 48000;
+    timer_frames = std::max(1.0, (AudioPeriod > 0 ? AudioPeriod : AudioBufferLength) * pcm_rate);
+    timer_buffer.resize(timer_frames * 2);
+    wav_buffer.resize(timer_frames * 2);
+    if(AudioOutput == AUDIOOUT_FILE && !OpenWAV(WAVFileName))
+    {
+        InitMessage(-1, "Couldn't open %s for writing\n", WAVFileName);
+        exit(1);
+    }
+    if(sample_rate)
+        *sample_rate = pcm_rate;
+}
+
+/** Stereo reverb, based on the Freeverb implementation in SoX.
+ * Each input channel feeds a bank of 8 parallel comb filters and 4 allpass
+ * filters in series for each output channel, with slightly different delay
+ * lengths left and right. The four input/output combinations are processed
+ * together as the lanes of one vector:
+ *   lane 0: left to left, 1: left to right, 2: right to left, 3: right to right
+ * The delay lines are preallocated power-of-two rings, so processing does not
+ * allocate and is safe in the audio callback.
  */
-class AudioPostprocessor: public AudioGenerator
+class Reverb
 {
 public:
-    AudioPostprocessor(AudioGenerator *source, UIInterface *ui):
-        source(source), ui(ui)
+    Reverb(double sample_rate,
+        double wet_gain_dB,
+        double room_scale, double reverberance, double fhf_damping, /* 0..1 */
+        double stereo_depth)
     {
+        /* Filter delay lengths in samples (44100Hz sample-rate) */
+        static const int comb_lengths[NumCombs] = {1116,1188,1277,1356,1422,1491,1557,1617};
+        static const int allpass_lengths[NumAllpasses] = {225,341,441,556};
+        const int stereo_adjust = 12;
+        double r = sample_rate * (1 / 44100.0); // Compensate for actual sample-rate
+        double scale = room_scale * .9 + .1;
+        double a =  -1 /  std::log(1 - /**/.3 /**/);          // Set minimum feedback
+        double b = 100 / (std::log(1 - /**/.98/**/) * a + 1); // Set maximum feedback
+        feedback = 1 - std::exp((reverberance*100.0 - b) / (a * b));
+        hf_damping = fhf_damping * .3 + .2;
+        gain = std::exp(wet_gain_dB * (std::log(10.0) * 0.05)) * .015;
+        for(unsigned lane = 0; lane < 4; ++lane)
+        {
+            // The output channel decides the stereo spread, alternating per filter
+            double offset = (lane & 1) * stereo_depth;
+            for(unsigned i = 0; i < NumCombs; ++i, offset = -offset)
+                comb[i].SetLength(lane, scale * r * (comb_lengths[i] + stereo_adjust * offset) + .5);
+            for(unsigned i = 0; i < NumAllpasses; ++i, offset = -offset)
+                allpass[i].SetLength(lane, r * (allpass_lengths[i] + stereo_adjust * offset) + .5);
+        }
+        for(unsigned i = 0; i < NumCombs; ++i)
+            comb[i].Allocate();
+        for(unsigned i = 0; i < NumAllpasses; ++i)
+            allpass[i].Allocate();
+        pos = 0;
     }
-    void RequestSamples(unsigned long count, float* samples)
+
+    /* Add the reverb of one frame to it */
+    void ProcessFrame(float &left, float &right, float input_scale)
     {
-        source->RequestSamples(count, samples);
-        // Attempt to filter out the DC component. However, avoid doing
-        // sudden changes to the offset, for it can be audible.
-        double average[2]={0,0};
-        for(unsigned w=0; w<2; ++w)
-            for(unsigned long p = 0; p < count; ++p)
-                average[w] += samples[p*2+w];
-        for(unsigned w=0; w<2; ++w)
-                average[w] /= double(count);
-        static float prev_avg_flt[2] = {0,0};
-        float average_flt[2] =
+        const v4sf fb = Splat(feedback), damp = Splat(hf_damping);
+        const v4sf half = Splat(.5f), out_gain = Splat(gain * .5f);
+        const float l = left * input_scale, r = right * input_scale;
+        // Tiny offset keeps the feedback loops out of denormal numbers
+        const v4sf in = {l + 1e-20f, l + 1e-20f, r + 1e-20f, r + 1e-20f};
+        v4sf out = Splat(0.f);
+        for(unsigned i = NumCombs; i-- > 0; )
         {
-            prev_avg_flt[0] = (prev_avg_flt[0] + average[0]*0.04) / 1.04,
-            prev_avg_flt[1] = (prev_avg_flt[1] + average[1]*0.04) / 1.04
-        };
-        // Figure out the amplitude of both channels
-        static unsigned amplitude_display_counter = 0;
-        if(!amplitude_display_counter--)
+            Filter &f = comb[i];
+            const v4sf delayed = f.Read(pos);
+            f.store = delayed + (f.store - delayed) * damp;
+            f.Write(pos, in + fb * f.store);
+            out += delayed;
+        }
+        // Schroeder allpass as in SoX and Freeverb. The old port added
+        // the filter output to its input, leaving only the delayed signal.
+        for(unsigned i = NumAllpasses; i-- > 0; )
         {
-            amplitude_display_counter = (pcm_rate / count) / VOLUME_UPDATE_FREQ;
-            double amp[2]={0,0};
-            for(unsigned w=0; w<2; ++w)
-            {
-                for(unsigned long p = 0; p < count; ++p)
-                    amp[w] += std::fabs(samples[p*2+w] - average[w]);
-                amp[w] /= double(count);
-                amp[w] *= 10240;
-                // Turn into logarithmic scale
-                const double dB = std::log(amp[w]<1 ? 1 : amp[w]) * 4.328085123;
-                const double maxdB = 3*16; // = 3 * log2(65536)
-                amp[w] = dB/maxdB;
-            }
-            ui->IllustrateVolumes(amp[0], amp[1]);
+            Filter &f = allpass[i];
+            const v4sf delayed = f.Read(pos);
+            f.Write(pos, out + delayed * half);
+            out = delayed - out;
         }
+        ++pos;
+        out *= out_gain;
+        left += out[0] + out[2];
+        right += out[1] + out[3];
+    }
+
+private:
+    typedef float v4sf __attribute__((vector_size(16)));
+    static const unsigned NumCombs = 8, NumAllpasses = 4;
+
+    /* Delay line shared by the four lanes, each with its own length */
+    struct Filter
+    {
+        std::vector<v4sf> buf;
+        unsigned mask;
+        unsigned length[4];
+        v4sf store; // Comb filter low-pass state
 
-        if(EnableReverb)
+        void SetLength(unsigned lane, unsigned len) { length[lane] = len; }
+        void Allocate()
         {
-            // TODO: reverb
+            unsigned longest = std::max(std::max(length[0], length[1]), std::max(length[2], length[3]));
+            buf.resize(upper_power_of_two(longest + 1), Splat(0.f));
+            mask = buf.size() - 1;
+            store = Splat(0.f);
         }
-        for(unsigned long p = 0; p < 2 * count; ++p)
-            samples[p] *= SAMPLE_MULT_OUTPUT_FLOAT;
+        v4sf Read(unsigned pos) const
+        {
+            v4sf d = {buf[(pos - length[0]) & mask][0], buf[(pos - length[1]) & mask][1],
+                      buf[(pos - length[2]) & mask][2], buf[(pos - length[3]) & mask][3]};
+            return d;
+        }
+        void Write(unsigned pos, v4sf value) { buf[pos & mask] = value; }
+    } comb[NumCombs], allpass[NumAllpasses];
+    float feedback, hf_damping, gain;
+    unsigned pos; // Write position of all delay lines
+
+    static v4sf Splat(float x)
+    {
+        v4sf v = {x, x, x, x};
+        return v;
+    }
+};
+
+/** Look-ahead brickwall limiter, linked across both channels.
+ *
+ * The output is delayed by the look-ahead time. The gain needed for the
+ * loudest frame within the look-ahead window, found with a monotonic
+ * queue, is smoothed by a moving average of the same length; that average
+ * has reached the needed gain by the time the peak leaves the delay line,
+ * so the output never exceeds the ceiling. Gain recovers with a slower
+ * release. Everything is O(1) per frame and preallocated.
+ */
+class Limiter
+{
+public:
+    Limiter(double sample_rate, double lookahead, double release, float ceiling):
+        length(std::max(1.0, lookahead * sample_rate)),
+        // The peak queue holds up to length+1 frames in the window plus
+        // the one pushed before the stale head is dropped
+        mask(upper_power_of_two(length + 2) - 1),
+        ceiling(ceiling),
+        release_coef(1 - std::exp(-1 / (release * sample_rate))),
+        delay(mask + 1), peaks(mask + 1), box(length, 1.f),
+        pos(0), head(0), tail(0), box_pos(0), box_sum(length), envelope(1)
+    {
+    }
+
+    void ProcessFrame(float &left, float &right)
+    {
+        // Loudest frame among the last length+1 ones
+        const float level = std::max(std::fabs(left), std::fabs(right));
+        while(head != tail && peaks[(tail - 1) & mask].level <= level)
+            --tail;
+        peaks[tail++ & mask] = Peak(level, pos);
+        while(pos - peaks[head & mask].pos > length)
+            ++head;
+        const float target = ceiling / std::max(peaks[head & mask].level, ceiling);
+
+        box_sum += target - box[box_pos];
+        box[box_pos] = target;
+        if(++box_pos == length)
+            box_pos = 0;
+        const float smoothed = box_sum / length;
+        if(smoothed < envelope)
+            envelope = smoothed;
+        else
+            envelope += (smoothed - envelope) * release_coef;
+
+        delay[pos & mask] = Frame(left, right);
+        const Frame &out = delay[(pos - length) & mask];
+        left = out.left * envelope;
+        right = out.right * envelope;
+        ++pos;
     }
 
 private:
-    AudioGenerator *source;
-    UIInterface *ui;
+    struct Frame
+    {
+        float left, right;
+        Frame(float left = 0, float right = 0): left(left), right(right) { }
+    };
+    struct Peak
+    {
+        float level;
+        unsigned pos;
+        Peak(float level = 0, unsigned pos = 0): level(level), pos(pos) { }
+    };
+    const unsigned length;  // Look-ahead in frames
+    const unsigned mask;    // For the delay line and the peak queue
+    const float ceiling, release_coef;
+    std::vector<Frame> delay;
+    std::vector<Peak> peaks; // Decreasing levels from head to tail
+    std::vector<float> box;  // Gains in the moving average
+    unsigned pos, head, tail, box_pos;
+    double box_sum;
+    float envelope;
 };
 
-void StartAudio(AudioGenerator *gen, MIDIReceiver *midi, UIInterface *ui)
+/** Wrap audio_gen to provide
+ *  - DC offset removal
+ *  - reverb
+ *  - final volume scaling, limiting and clipping
+ *  - conversion to 16-bit samples for the devices that want them
+ *  - a decimated copy of the output for the UI to analyze
+ * All of it is done in a single pass over each block.
+ */
+class AudioPostprocessor: public AudioGenerator
 {
-    audio_postprocessor = new AudioPostprocessor(gen, ui);
-    audio_gen = audio_postprocessor;
-    if (midi)
+public:
+    AudioPostprocessor(AudioGenerator *source, AudioTap *tap):
+        source(source), tap(tap),
+        output_gain(SAMPLE_MULT_OUTPUT_FLOAT * std::pow(10.0, OutputGain / 20)),
+        reverb(pcm_rate,
+            6.0,  // wet_gain_dB  (-10..10)
+            .7,   // room_scale   (0..1)
+            .6,   // reverberance (0..1)
+            .8,   // hf_damping   (0..1)
+            1),   // stereo_depth (0..1)
+        limiter(pcm_rate,
+            LimiterLookahead,
+            0.1,   // release in seconds
+            0.98f) // ceiling
     {
-        const char * const midi_portnames[] = { "midi_1" };
-        for(int port=0; port<NUM_MIDI_PORTS; ++port)
+        for(unsigned w=0; w<2; ++w)
+            dc[w] = dc_sum[w] = 0;
+    }
+    void RequestSamples(unsigned long count, float* samples)
+    {
+        source->RequestSamples(count, samples);
+        Process<2>(count, samples, samples+1, FloatOutput(samples, samples+1, 2));
+        UpdateDC(count);
+    }
+    void RequestSamplesPlanar(unsigned long count, float* left, float* right)
+    {
+        source->RequestSamplesPlanar(count, left, right);
+        Process<1>(count, left, right, FloatOutput(left, right, 1));
+        UpdateDC(count);
+    }
+    /** Same as RequestSamples, but produce interleaved 16-bit samples */
+    void RequestSamplesS16(unsigned long count, short* samples)
+    {
+        float in[MaxSamplesAtTime*2]; /* need temporary buffer for interleaved samples */
+        for(unsigned long done = 0; done < count; )
         {
-            midi_port[port] = jack_port_register(client, midi_portnames[port],
-                                             JACK_DEFAULT_MIDI_TYPE,
-                                             JackPortIsInput, 0);
-            if (midi_port[port] == NULL) {
-                InitMessage(-1, "no more JACK midi ports available\n");
-                exit(1);
-            }
+            unsigned long n = std::min(count - done, (unsigned long)MaxSamplesAtTime);
+            source->RequestSamples(n, in);
+            Process<2>(n, in, in+1, S16Output(samples + done*2));
+            done += n;
         }
-
-        midi_if = midi;
+        UpdateDC(count);
+    }
+    bool Finished() const
+    {
+        return source->Finished();
     }
-}
-
-#if 0
-    /// Code for reverb
 
-struct Reverb /* This reverb implementation is based on Freeverb impl. in Sox */
-{
-    float feedback, hf_damping, gain;
-    struct FilterArray
+private:
+    AudioGenerator *source;
+    AudioTap *tap;
+    const float output_gain;
+    float dc[2];               // Slowly moving DC offset estimate
+    float dc_sum[2];           // Input summed over the current request
+    Reverb reverb;
+    Limiter limiter;
+
+    struct FloatOutput
     {
-        struct Filter
+        float *left, *right;
+        int step;
+        FloatOutput(float *left, float *right, int step): left(left), right(right), step(step) { }
+        void operator()(unsigned long p, float l, float r) const
         {
-            std::vector<float> Ptr;  size_t pos;  float Store;
-            void Create(size_t size) { Ptr.resize(size); pos = 0; Store = 0.f; }
-            float Update(float a, float b)
-            {
-                Ptr[pos] = a;
-                if(!pos) pos = Ptr.size()-1; else --pos;
-                return b;
-            }
-            float ProcessComb(float input, const float feedback, const float hf_damping)
-            {
-                Store = Ptr[pos] + (Store - Ptr[pos]) * hf_damping;
-                return Update(input + feedback * Store, Ptr[pos]);
-            }
-            float ProcessAllPass(float input)
-            {
-                return Update(input + Ptr[pos] * .5f, Ptr[pos]-input);
-            }
-        } comb[8], allpass[4];
-        void Create(double rate, double scale, double offset)
+            left[p*step] = l;
+            right[p*step] = r;
+        }
+    };
+    struct S16Output
+    {
+        short *out;
+        S16Output(short *out): out(out) { }
+        void operator()(unsigned long p, float l, float r) const
         {
-            /* Filter delay lengths in samples (44100Hz sample-rate) */
-            static const int comb_lengths[8] = {1116,1188,1277,1356,1422,1491,1557,1617};
-            static const int allpass_lengths[4] = {225,341,441,556};
-            double r = rate * (1 / 44100.0); // Compensate for actual sample-rate
-            const int stereo_adjust = 12;
-            for(size_t i=0; i<8; ++i, offset=-offset)
-                comb[i].Create( scale * r * (comb_lengths[i] + stereo_adjust * offset) + .5 );
-            for(size_t i=0; i<4; ++i, offset=-offset)
-                allpass[i].Create( r * (allpass_lengths[i] + stereo_adjust * offset) + .5 );
+            out[p*2+0] = l * 32767.0f;
+            out[p*2+1] = r * 32767.0f;
         }
-        void Process(size_t length,
-            const std::deque<float>& input, std::vector<float>& output,
-            const float feedback, const float hf_damping, const float gain)
+    };
+
+    static float HardClip(float x)
+    {
+        return std::min(std::max(x, -1.0f), 1.0f);
+    }
+    /* Linear up to the knee, then bends smoothly towards full scale */
+    static float SoftClip(float x)
+    {
+        const float knee = 0.75f;
+        const float a = std::fabs(x);
+        if(a <= knee)
+            return x;
+        const float y = knee + (1 - knee) * std::tanh((a - knee) / (1 - knee));
+        return x < 0 ? -y : y;
+    }
+
+    template<int Step, class Output>
+    void Process(unsigned long count, const float* left, const float* right, Output out)
+    {
+        switch((EnableReverb ? 4 : 0) | (LimiterLookahead > 0 ? 2 : 0) | (SoftClipping ? 1 : 0))
         {
-            for(size_t a=0; a<length; ++a)
-            {
-                float out = 0, in = input[a];
-                for(size_t i=8; i-- > 0; ) out += comb[i].ProcessComb(in, feedback, hf_damping);
-                for(size_t i=4; i-- > 0; ) out += allpass[i].ProcessAllPass(out);
-                output[a] = out * gain;
-            }
+        case 0: Run<Step, false, false, false>(count, left, right, out); break;
+        case 1: Run<Step, false, false, true >(count, left, right, out); break;
+        case 2: Run<Step, false, true,  false>(count, left, right, out); break;
+        case 3: Run<Step, false, true,  true >(count, left, right, out); break;
+        case 4: Run<Step, true,  false, false>(count, left, right, out); break;
+        case 5: Run<Step, true,  false, true >(count, left, right, out); break;
+        case 6: Run<Step, true,  true,  false>(count, left, right, out); break;
+        case 7: Run<Step, true,  true,  true >(count, left, right, out); break;
         }
-    } chan[2];
-    std::vector<float> out[2];
-    std::deque<float> input_fifo;
+    }
 
-    void Create(double sample_rate_Hz,
-        double wet_gain_dB,
-        double room_scale, double reverberance, double fhf_damping, /* 0..1 */
-        double pre_delay_s, double stereo_depth,
-        size_t buffer_size)
+    /* The fused kernel. The input may be the same memory as the output. */
+    template<int Step, bool WithReverb, bool WithLimiter, bool Soft, class Output>
+    void Run(unsigned long count, const float* left, const float* right, Output out)
     {
-        size_t delay = pre_delay_s  * sample_rate_Hz + .5;
-        double scale = room_scale * .9 + .1;
-        double depth = stereo_depth;
-        double a =  -1 /  std::log(1 - /**/.3 /**/);          // Set minimum feedback
-        double b = 100 / (std::log(1 - /**/.98/**/) * a + 1); // Set maximum feedback
-        feedback = 1 - std::exp((reverberance*100.0 - b) / (a * b));
-        hf_damping = fhf_damping * .3 + .2;
-        gain = std::exp(wet_gain_dB * (std::log(10.0) * 0.05)) * .015;
-        input_fifo.insert(input_fifo.end(), delay, 0.f);
-        for(size_t i = 0; i <= std::ceil(depth); ++i)
+        // The DC offset estimated from the previous requests is removed here,
+        // while this request's average is gathered for the next one.
+        const float dc_l = dc[0], dc_r = dc[1];
+        float sum_l = 0, sum_r = 0;
+        for(unsigned long p = 0; p < count; ++p)
         {
-            chan[i].Create(sample_rate_Hz, scale, i * depth);
-            out[i].resize(buffer_size);
+            const float in_l = left[p*Step], in_r = right[p*Step];
+            sum_l += in_l;
+            sum_r += in_r;
+            float l = in_l - dc_l, r = in_r - dc_r;
+            if(WithReverb)
+                reverb.ProcessFrame(l, r, ReverbScale);
+            l *= output_gain;
+            r *= output_gain;
+            if(WithLimiter)
+                limiter.ProcessFrame(l, r);
+            l = Soft ? SoftClip(l) : HardClip(l);
+            r = Soft ? SoftClip(r) : HardClip(r);
+            out(p, l, r);
+            tap->Put(l, r);
         }
+        tap->Flush();
+        dc_sum[0] += sum_l;
+        dc_sum[1] += sum_r;
     }
-    void Process(size_t length)
+
+    /* Move the DC offset estimate towards the average of the count frames
+     * just processed. Avoid doing sudden changes to the offset, for it can
+     * be audible.
+     */
+    void UpdateDC(unsigned long count)
     {
-        for(size_t i=0; i<2; ++i)
-            if(!out[i].empty())
-                chan[i].Process(length,
-                    input_fifo,
-                    out[i], feedback, hf_damping, gain);
-        input_fifo.erase(input_fifo.begin(), input_fifo.begin() + length);
+        for(unsigned w=0; w<2; ++w)
+        {
+            if(count)
+                dc[w] = (dc[w] + dc_sum[w] / count * 0.04f) / 1.04f;
+            dc_sum[w] = 0;
+        }
     }
 };
-static struct MyReverbData
+
+static void RequestSamplesS16(unsigned long count, short *samples)
 {
-    bool wetonly;
-    Reverb chan[2];
+    if(audio_postprocessor)
+        audio_postprocessor->RequestSamplesS16(count, samples);
+    else
+        memset(samples, 0, count*2*sizeof(short));
+}
 
-    MyReverbData() : wetonly(false)
+/** Run source in a separate thread that renders ahead into a ring buffer,
+ * so that the audio callback only has to copy out samples. Spikes in
+ * synthesis time are absorbed by the buffer instead of causing underruns.
+ */
+class RenderAhead: public AudioGenerator
+{
+public:
+    RenderAhead(AudioGenerator *source, unsigned frames):
+        source(source),
+        ring(std::max(frames, 2*MaxSamplesAtTime)),
+        underruns(0),
+        running(true)
     {
-        for(size_t i=0; i<2; ++i)
-            chan[i].Create(pcm_rate,
-                6.0,  // wet_gain_dB  (-10..10)
-                .7,   // room_scale   (0..1)
-                .6,   // reverberance (0..1)
-                .8,   // hf_damping   (0..1)
-                .000, // pre_delay_s  (0.. 0.5)
-                1,   // stereo_depth (0..1)
-                MaxSamplesAtTime);
+        Fill(); // Start out with a full buffer
+        thread = SDL_CreateThread(RenderThread, this);
+    }
+    ~RenderAhead()
+    {
+        Stop();
     }
-} reverb_data;
 
-    if(EnableReverb)
+    void RequestSamples(unsigned long count, float* samples)
     {
-        std::vector<float> dry;
-        dry.resize(count);
-        // Insert input into reverb fifo
-        for(unsigned w=0; w<2; ++w)
+        Consume(count, samples, samples+1, 2);
+    }
+    void RequestSamplesPlanar(unsigned long count, float* left, float* right)
+    {
+        Consume(count, left, right, 1);
+    }
+    bool Finished() const
+    {
+        return source->Finished() && !ring.Available();
+    }
+
+    /** Stop the render thread; what is buffered can still be played */
+    void Stop()
+    {
+        if(!thread)
+            return;
+        running = false;
+        wakeup.Post();
+        SDL_WaitThread(thread, NULL);
+        thread = 0;
+    }
+    double FillLevel() const { return ring.Available() / (double)ring.Capacity(); }
+    unsigned Underruns() const { return underruns.load(std::memory_order_relaxed); }
+    unsigned Buffered() const { return ring.Available(); }
+
+private:
+    AudioGenerator *source;
+    FrameRingBuffer ring;
+    std::atomic<unsigned> underruns;
+    std::atomic<bool> running;
+    SemaphoreType wakeup; // Posted by the audio callback after taking samples
+    SDL_Thread *thread;
+
+    void Consume(unsigned long count, float* left, float* right, int step)
+    {
+        unsigned long got = ring.Read(left, right, step, count);
+        if(got < count)
         {
-            const float a = average_flt[w];
-            for(unsigned long p = 0; p < count; ++p)
-            {
-                dry[p] = (samples[p*2+w] - a) * ReverbScale;
-            }
-            // ^  Note: ftree-vectorize causes an error in this loop on g++-4.4.5
-            reverb_data.chan[w].input_fifo.insert(
-            reverb_data.chan[w].input_fifo.end(),
-                dry.begin(), dry.end());
+            for(unsigned long a = got; a < count; ++a)
+                left[a*step] = right[a*step] = 0.0f;
+            // Running dry after Stop() or the end of the song is expected
+            if(running && !source->Finished())
+                underruns.fetch_add(1, std::memory_order_relaxed);
         }
-        // Reverbify it
-        for(unsigned w=0; w<2; ++w)
-            reverb_data.chan[w].Process(count);
+        wakeup.Post();
     }
-
-    if(EnableReverb)
+    void Fill()
     {
-        for(unsigned long p = 0; p < count; ++p)
+        float left[MaxSamplesAtTime], right[MaxSamplesAtTime];
+        while(running && !source->Finished() && ring.Space() >= MaxSamplesAtTime)
         {
-            for(unsigned w = 0; w < 2; ++w)
-            {
-                const float dry = samples[p*2 + w] - average_flt[w];
-                const float wet = ((1 - reverb_data.wetonly) * dry +
-                    .5 * (reverb_data.chan[0].out[w][p]
-                        + reverb_data.chan[1].out[w][p]));
-                AudioBuffer.push_back(sample_from_float(wet));
-            }
+            source->RequestSamplesPlanar(MaxSamplesAtTime, left, right);
+            ring.Write(left, right, MaxSamplesAtTime);
         }
     }
-#endif
+    static int RenderThread(void *data)
+    {
+        RenderAhead *self = (RenderAhead*)data;
+        while(self->running)
+        {
+            self->Fill();
+            self->wakeup.Wait();
+        }
+        return 0;
+    }
+};
 
-void ShutdownAudio()
+void StartAudio(AudioGenerator *gen, MIDIReceiver *midi, UIInterface *ui, double render_ahead_time)
 {
+    if(render_ahead_time > 0)
+    {
+        render_ahead = new RenderAhead(gen, render_ahead_time * pcm_rate);
+        gen = render_ahead;
+    }
+    // The UI analyzes the output on its own thread
+    audio_tap = new AudioTap(pcm_rate, 2);
+    tap_ui = ui;
+    ui->AttachAudioTap(audio_tap);
+    audio_postprocessor = new AudioPostprocessor(gen, audio_tap);
+    audio_gen = audio_postprocessor;
+    if(AudioOutput != AUDIOOUT_DEVICE)
+    {
+        timer_running = true;
+        timer_thread = SDL_CreateThread(TimerThread, 0);
+        return;
+    }
 #ifdef AUDIO_SDL
-    SDL_CloseAudio();
+    SDL_PauseAudio(0);
 #endif
 #ifdef AUDIO_JACK
-    jack_deactivate(client);
-    for(int port=0; port<2; ++port)
-        jack_port_unregister(client, output_port[port]);
-    if (midi_if)
+    if (midi)
     {
-        for(int port=0; port<NUM_MIDI_PORTS; ++port)
-            jack_port_unregister(client, midi_port[port]);
+        for(unsigned port=0; port<NumMIDIPorts; ++port)
+        {
+            char portname[16];
+            std::snprintf(portname, sizeof(portname), "midi_%u", port + 1);
+            midi_port[port] = jack_port_register(client, portname,
+                                             JACK_DEFAULT_MIDI_TYPE,
+                                             JackPortIsInput, 0);
+            if (midi_port[port] == NULL) {
+                InitMessage(-1, "no more JACK midi ports available\n");
+                exit(1);
+            }
+        }
+
+        midi_if = midi;
     }
-    jack_client_close(client);
+#else
+    (void)midi; // Only JACK delivers MIDI from the audio driver
 #endif
+}
+
+bool RenderAheadStatus(double *fill, unsigned *underruns)
+{
+    if(!render_ahead)
+        return false;
+    *fill = render_ahead->FillLevel();
+    *underruns = render_ahead->Underruns();
+    return true;
+}
+
+void AudioCallbackSummary(char *buf, size_t size)
+{
+    callback_monitor.Summary(buf, size);
+}
+
+void DrainAudio()
+{
+    if(!render_ahead)
+        return;
+    render_ahead->Stop();
+    // Give up if the audio device stops taking samples
+    unsigned timeout_ms = render_ahead->Buffered() * 1000ULL / pcm_rate + 1000;
+    for(unsigned ms = 0; render_ahead->Buffered() && ms < timeout_ms; ms += 10)
+        SDL_Delay(10);
+}
+
+void ShutdownAudio()
+{
+    if(AudioOutput == AUDIOOUT_DEVICE)
+        ShutdownDevice();
+    else if(timer_thread)
+    {
+        timer_running = false;
+        SDL_WaitThread(timer_thread, NULL);
+        timer_thread = 0;
+    }
+    CloseWAV();
+    delete render_ahead;
+    render_ahead = 0;
     audio_gen = 0;
     delete audio_postprocessor;
+    audio_postprocessor = 0;
+    if(tap_ui)
+        tap_ui->AttachAudioTap(0);
+    tap_ui = 0;
+    delete audio_tap;
+    audio_tap = 0;
 }
 
@@ -1,6 +1,7 @@
 #ifndef H_AUDIOOUT
 #define H_AUDIOOUT
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -13,6 +14,14 @@ public:
     virtual ~AudioGenerator() = 0;
 
     virtual void RequestSamples(unsigned long count, float* samples) = 0;
+    /** Same as RequestSamples, but into separate left and right buffers.
+     * The default implementation de-interleaves through a temporary buffer.
+     */
+    virtual void RequestSamplesPlanar(unsigned long count, float* left, float* right);
+    /** True once there is nothing more to play. The null and file outputs
+     * stop requesting samples then, the audio devices keep going.
+     */
+    virtual bool Finished() const { return false; }
 };
 
 /**
@@ -32,10 +41,23 @@ class UIInterface;
 
 /** Initialize audio system, in paused state,
  * create a buffer of AudioBufferLength seconds.
+ * With -null or -w, no audio device is opened; instead a timer thread
+ * requests samples every AudioBufferLength seconds (or -period).
  */
 void InitializeAudio(double AudioBufferLength, unsigned int *sample_rate);
-/** Start audio playing from audio generator gen */
-void StartAudio(AudioGenerator *gen, MIDIReceiver *midi, UIInterface *ui);
+/** Start audio playing from audio generator gen.
+ * If render_ahead is nonzero, gen is run in a separate thread that keeps
+ * render_ahead seconds of audio buffered, instead of in the audio callback.
+ */
+void StartAudio(AudioGenerator *gen, MIDIReceiver *midi, UIInterface *ui, double render_ahead = 0);
+/** Get the fill level (0..1) of the render-ahead buffer and the number of
+ * underruns so far. Returns false if audio is not rendered ahead.
+ */
+bool RenderAheadStatus(double *fill, unsigned *underruns);
+/** Write a one-line summary of the audio callback timing to buf */
+void AudioCallbackSummary(char *buf, size_t size);
+/** Stop rendering ahead and wait until the buffered audio has played */
+void DrainAudio();
 /** Shutdown audio system */
 void ShutdownAudio();
 
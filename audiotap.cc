@@ -0,0 +1,119 @@
+#include "audiotap.hh"
+
+#include <algorithm>
+#include <cmath>
+
+AudioTap::AudioTap(unsigned sample_rate, unsigned factor):
+    ring(sample_rate / factor / 2),
+    factor(factor), rate(sample_rate / factor),
+    scale(1.0f / factor),
+    summed(0), staged(0)
+{
+    sum[0] = sum[1] = 0;
+}
+
+void AudioTap::Flush()
+{
+    // The newest frames that do not fit are dropped
+    unsigned count = std::min(staged, ring.Space());
+    ring.Write(stage[0], stage[1], count);
+    staged = 0;
+}
+
+const double AudioAnalyzer::MinFrequency = 40.0;
+
+AudioAnalyzer::AudioAnalyzer():
+    history(FFTSize), history_pos(0),
+    window(FFTSize), twiddle(FFTSize / 2), bins(FFTSize), power(FFTSize / 2),
+    left(FFTSize), right(FFTSize),
+    rate(0)
+{
+    const double pi = 3.14159265358979323846;
+    for(unsigned i = 0; i < FFTSize; ++i)
+        window[i] = 0.5 - 0.5 * std::cos(2 * pi * i / FFTSize); // Hann
+    for(unsigned k = 0; k < FFTSize / 2; ++k)
+        twiddle[k] = std::polar(1.0f, float(-2 * pi * k / FFTSize));
+    for(unsigned w = 0; w < 2; ++w)
+        peak[w] = rms[w] = 0;
+}
+
+bool AudioAnalyzer::Update(AudioTap *tap)
+{
+    rate = tap->Rate();
+    unsigned total = 0;
+    float new_peak[2] = {0, 0};
+    double squares[2] = {0, 0};
+    for(unsigned n; (n = tap->Read(&left[0], &right[0], left.size())) != 0; total += n)
+    {
+        for(unsigned a = 0; a < n; ++a)
+        {
+            new_peak[0] = std::max(new_peak[0], std::fabs(left[a]));
+            new_peak[1] = std::max(new_peak[1], std::fabs(right[a]));
+            squares[0] += left[a] * left[a];
+            squares[1] += right[a] * right[a];
+            history[history_pos] = (left[a] + right[a]) * 0.5f;
+            history_pos = (history_pos + 1) % FFTSize;
+        }
+    }
+    if(!total)
+        return false;
+    for(unsigned w = 0; w < 2; ++w)
+    {
+        peak[w] = new_peak[w];
+        rms[w] = std::sqrt(squares[w] / total);
+    }
+    Transform();
+    return true;
+}
+
+/* Radix-2 FFT of the windowed history into power per bin */
+void AudioAnalyzer::Transform()
+{
+    unsigned bits = 0;
+    while((1u << bits) < FFTSize)
+        ++bits;
+    for(unsigned i = 0; i < FFTSize; ++i)
+    {
+        unsigned reversed = 0;
+        for(unsigned b = 0; b < bits; ++b)
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        bins[reversed] = history[(history_pos + i) % FFTSize] * window[i];
+    }
+    for(unsigned len = 2; len <= FFTSize; len *= 2)
+    {
+        const unsigned half = len / 2, step = FFTSize / len;
+        for(unsigned i = 0; i < FFTSize; i += len)
+            for(unsigned j = 0; j < half; ++j)
+            {
+                const std::complex<float> u = bins[i + j];
+                const std::complex<float> v = bins[i + j + half] * twiddle[j * step];
+                bins[i + j] = u + v;
+                bins[i + j + half] = u - v;
+            }
+    }
+    // A full scale sine peaks at FFTSize/4 with the Hann window
+    const float full_scale = float(FFTSize / 4) * float(FFTSize / 4);
+    for(unsigned k = 0; k < FFTSize / 2; ++k)
+        power[k] = std::norm(bins[k]) / full_scale;
+}
+
+void AudioAnalyzer::Spectrum(float *bands_dB, unsigned num) const
+{
+    const double bin_width = double(rate) / FFTSize;
+    const double top = rate / 2.0;
+    for(unsigned b = 0; b < num; ++b)
+    {
+        float sum = 0;
+        if(rate)
+        {
+            // Bands narrower than a bin show the bin they fall in
+            const double low = MinFrequency * std::pow(top / MinFrequency, double(b) / num);
+            const double high = MinFrequency * std::pow(top / MinFrequency, double(b + 1) / num);
+            unsigned first = std::max(1u, unsigned(low / bin_width));
+            unsigned last = std::min(std::max(first + 1, unsigned(high / bin_width)), FFTSize / 2);
+            for(unsigned k = first; k < last; ++k)
+                sum += power[k];
+        }
+        bands_dB[b] = 10 * std::log10(sum + 1e-12f);
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef H_AUDIOTAP
+#define H_AUDIOTAP
+
+#include "ringbuffer.hh"
+
+#include <complex>
+#include <vector>
+
+/** Decimated copy of the audio output, for visualization.
+ * The audio thread adds frames with Put and publishes them with Flush,
+ * which never block or allocate. One other thread reads them, normally
+ * through an AudioAnalyzer. Frames that do not fit are dropped.
+ */
+class AudioTap
+{
+public:
+    /* Keep one of every factor frames, averaged, for up to half a second */
+    AudioTap(unsigned sample_rate, unsigned factor);
+
+    /* Sample rate of the decimated frames */
+    unsigned Rate() const { return rate; }
+
+    /* Audio thread: add one output frame */
+    void Put(float left, float right)
+    {
+        sum[0] += left;
+        sum[1] += right;
+        if(++summed < factor)
+            return;
+        stage[0][staged] = sum[0] * scale;
+        stage[1][staged] = sum[1] * scale;
+        sum[0] = sum[1] = 0;
+        summed = 0;
+        if(++staged == StageSize)
+            Flush();
+    }
+    /* Audio thread: make the frames added so far available to the reader */
+    void Flush();
+
+    /* Reader: take up to count frames, returns the number read */
+    unsigned Read(float *left, float *right, unsigned count)
+    {
+        return ring.Read(left, right, 1, count);
+    }
+
+private:
+    static const unsigned StageSize = 256;
+    FrameRingBuffer ring;
+    const unsigned factor, rate;
+    const float scale;
+    float sum[2];
+    unsigned summed;
+    float stage[2][StageSize];
+    unsigned staged;
+};
+
+/** Level meters and spectrum of what comes out of an AudioTap.
+ * All the analysis is done on the thread that calls Update.
+ */
+class AudioAnalyzer
+{
+public:
+    AudioAnalyzer();
+
+    /* Read everything the tap has. Returns false when nothing came in */
+    bool Update(AudioTap *tap);
+
+    /* Levels over the frames of the last update, full scale is 1 */
+    float peak[2], rms[2];
+
+    /* Level in dB relative to a full scale sine of num bands, spaced
+     * logarithmically from MinFrequency up to half the tap rate */
+    void Spectrum(float *bands_dB, unsigned num) const;
+
+    static const double MinFrequency;
+
+private:
+    static const unsigned FFTSize = 1024;
+    std::vector<float> history; // Last FFTSize mono frames, oldest at history_pos
+    unsigned history_pos;
+    std::vector<float> window;
+    std::vector<std::complex<float> > twiddle;
+    std::vector<std::complex<float> > bins;
+    std::vector<float> power;   // FFTSize/2 bins
+    std::vector<float> left, right;
+    unsigned rate;
+
+    void Transform();
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "callbackmonitor.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <time.h>
+
+static const uint64_t NANOS_PER_S = 1000000000ULL;
+
+CallbackMonitor::CallbackMonitor():
+    callbacks(0), late(0), xruns(0), max_ppm(0), last_start(0), max_interval_ns(0)
+{
+    for(unsigned b = 0; b < NumBuckets; ++b)
+        histogram[b] = 0;
+}
+
+uint64_t CallbackMonitor::Begin() const
+{
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * NANOS_PER_S + tv.tv_nsec;
+}
+
+void CallbackMonitor::End(uint64_t start, unsigned long frames, unsigned sample_rate)
+{
+    if(!frames || !sample_rate)
+        return;
+    const uint64_t elapsed = Begin() - start;
+    const double fraction = elapsed * (double)sample_rate / ((double)frames * NANOS_PER_S);
+
+    unsigned bucket = fraction * BucketsPerPeriod;
+    if(bucket >= NumBuckets)
+        bucket = NumBuckets - 1;
+    histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    if(fraction >= 1.0)
+        late.fetch_add(1, std::memory_order_relaxed);
+
+    // Only the audio thread writes these, so load-compare-store is enough
+    const unsigned ppm = fraction * 1e6 < 4e9 ? (unsigned)(fraction * 1e6) : 4000000000U;
+    if(ppm > max_ppm.load(std::memory_order_relaxed))
+        max_ppm.store(ppm, std::memory_order_relaxed);
+    const uint64_t prev = last_start.exchange(start, std::memory_order_relaxed);
+    if(prev && start - prev > max_interval_ns.load(std::memory_order_relaxed))
+        max_interval_ns.store(start - prev, std::memory_order_relaxed);
+
+    callbacks.fetch_add(1, std::memory_order_relaxed);
+}
+
+double CallbackMonitor::Percentile(double p, unsigned total) const
+{
+    const double target = p * total;
+    unsigned sum = 0;
+    for(unsigned b = 0; b < NumBuckets; ++b)
+    {
+        sum += histogram[b].load(std::memory_order_relaxed);
+        if(sum >= target)
+            return (b + 1) / (double)BucketsPerPeriod;
+    }
+    return NumBuckets / (double)BucketsPerPeriod;
+}
+
+void CallbackMonitor::Summary(char *buf, size_t size) const
+{
+    const unsigned total = callbacks.load(std::memory_order_relaxed);
+    if(!total)
+    {
+        std::snprintf(buf, size, "Audio callback: no callbacks yet");
+        return;
+    }
+    // Histogram buckets are reported by their upper edge, which can lie above the maximum
+    const double max = max_ppm.load(std::memory_order_relaxed) / 1e6;
+    std::snprintf(buf, size,
+        "Audio callback: %u calls, render time p50 %.1f%% p99 %.1f%% max %.1f%% of period, "
+        "%u late, %u xruns, longest interval %.1f ms",
+        total,
+        std::min(Percentile(0.50, total), max) * 100.0,
+        std::min(Percentile(0.99, total), max) * 100.0,
+        max * 100.0,
+        late.load(std::memory_order_relaxed),
+        xruns.load(std::memory_order_relaxed),
+        max_interval_ns.load(std::memory_order_relaxed) / 1e6);
+}
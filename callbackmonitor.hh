@@ -0,0 +1,44 @@
+#ifndef H_CALLBACKMONITOR
+#define H_CALLBACKMONITOR
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Measure how much of its deadline the audio callback uses.
+ * Begin and End are called from the audio thread and never block or
+ * allocate; the statistics can be read from any thread.
+ */
+class CallbackMonitor
+{
+public:
+    // Render time histogram, in fractions of the period
+    static const unsigned BucketsPerPeriod = 200;
+    static const unsigned NumBuckets = 2 * BucketsPerPeriod + 1; // up to 2 periods, last is overflow
+
+    CallbackMonitor();
+
+    /* Audio thread: timestamp at the start of the callback */
+    uint64_t Begin() const;
+    /* Audio thread: end of a callback that started at start and
+     * produced frames samples at sample_rate */
+    void End(uint64_t start, unsigned long frames, unsigned sample_rate);
+    /* Audio driver reported an xrun */
+    void CountXrun() { xruns.fetch_add(1, std::memory_order_relaxed); }
+
+    /* Write a one-line summary of the statistics to buf */
+    void Summary(char *buf, size_t size) const;
+private:
+    std::atomic<unsigned> histogram[NumBuckets];
+    std::atomic<unsigned> callbacks;
+    std::atomic<unsigned> late;     // Callbacks that took longer than their period
+    std::atomic<unsigned> xruns;
+    std::atomic<unsigned> max_ppm;  // Worst render time, parts per million of the period
+    std::atomic<uint64_t> last_start;
+    std::atomic<uint64_t> max_interval_ns; // Longest time between callbacks
+
+    // Fraction of the period below which the given fraction of callbacks finished
+    double Percentile(double p, unsigned total) const;
+};
+
+#endif
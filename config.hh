@@ -9,10 +9,24 @@ OPLEMU_VintageTone,  // 'That vintage tone' emulator by Robson Cozendey ported t
 OPLEMU_YMF262        // YMF262 from MAME (via VGMPlay)
 };
 
+enum AudioOutputType
+{
+AUDIOOUT_DEVICE,     // SDL or JACK, whichever was built in
+AUDIOOUT_NULL,       // Render on a timer and discard the output
+AUDIOOUT_FILE        // Render on a timer into a WAV file
+};
+
+enum ScanFormatType
+{
+SCAN_NONE,           // Play the song
+SCAN_JSON,           // Print song information as JSON
+SCAN_CSV             // Print song information as CSV
+};
+
 static const unsigned MaxCards = 100;
+static const unsigned MaxMIDIPorts = 16;
 static const unsigned MaxSamplesAtTime = 512; // 512=dbopl limitation
 static const unsigned MaxWidth = 120;
-static const unsigned MaxHeight = 1 + 23*MaxCards;
 static const float SAMPLE_MULT_OUTPUT_FLOAT = 0.33f; // Scaling applied to output samples
 static const double ReverbScale = 0.1;
 
@@ -23,12 +37,32 @@ extern bool HighTremoloMode;
 extern bool HighVibratoMode;
 extern bool AdlPercussionMode;
 extern bool QuitWithoutLooping;
-extern bool WritePCMfile;
 extern bool ScaleModulators;
 extern OPLEmuType EmuType;
 extern bool FullPan;
 extern bool AllowBankSwitch;
 extern bool EnableReverb;
+extern bool SoftClipping;
+extern double OutputGain;
+extern double LimiterLookahead;
+extern unsigned XMISequence;
+extern bool AnalyzeSong;
+extern bool PlaylistMode;
+extern int LoopCount;
+extern double FadeOutTime;
+extern double MaxDuration;
+extern ScanFormatType ScanFormat;
+extern bool DirectMIDIInput;
+extern double RenderAheadTime;
+extern unsigned NumMIDIPorts;
+extern bool CardOutputs;
+extern bool MasterMix;
+extern AudioOutputType AudioOutput;
+extern const char *WAVFileName;
+extern double AudioPeriod;
+extern bool FreeRunAudio;
+extern bool QtFrontend;
+extern bool ChannelMeters;
 
 #endif
 
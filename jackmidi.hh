@@ -0,0 +1,62 @@
+#ifndef H_JACKMIDI
+#define H_JACKMIDI
+
+#include "config.hh"
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+/** Iterate over the events of several JACK MIDI input ports in timestamp
+ * order. Events within one port buffer are already sorted, so this is a
+ * merge that picks the earliest pending event each time.
+ * Called from the JACK process callback; does not allocate.
+ */
+class JackMIDIMerge
+{
+    void *buffers[MaxMIDIPorts];
+    jack_nframes_t count[MaxMIDIPorts];
+    jack_nframes_t next[MaxMIDIPorts];
+    jack_nframes_t time[MaxMIDIPorts]; // Timestamp of next event, if any
+    unsigned num_ports;
+
+    void Peek(unsigned port)
+    {
+        jack_midi_event_t event;
+        if(next[port] < count[port] && jack_midi_event_get(&event, buffers[port], next[port]) == 0)
+            time[port] = event.time;
+        else
+            next[port] = count[port];
+    }
+public:
+    JackMIDIMerge(jack_port_t * const *ports, unsigned num_ports, jack_nframes_t nframes):
+        num_ports(num_ports)
+    {
+        for(unsigned port = 0; port < num_ports; ++port)
+        {
+            buffers[port] = jack_port_get_buffer(ports[port], nframes);
+            count[port] = jack_midi_get_event_count(buffers[port]);
+            next[port] = 0;
+            Peek(port);
+        }
+    }
+
+    /* Get the next event in time and the index of the port it arrived on.
+     * Returns false when all events have been read. Ties go to the lowest port.
+     */
+    bool Next(jack_midi_event_t *event, unsigned *port)
+    {
+        int best = -1;
+        for(unsigned p = 0; p < num_ports; ++p)
+            if(next[p] < count[p] && (best < 0 || time[p] < time[best]))
+                best = p;
+        if(best < 0)
+            return false;
+        jack_midi_event_get(event, buffers[best], next[best]);
+        *port = best;
+        ++next[best];
+        Peek(best);
+        return true;
+    }
+};
+
+#endif
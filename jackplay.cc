@@ -1,6 +1,8 @@
 /* Standalone JACK softsynth */
 #include "adldata.hh"
+#include "callbackmonitor.hh"
 #include "config.hh"
+#include "jackmidi.hh"
 #include "midievt.hh"
 #include "parseargs.hh"
 #include "ui.hh"
@@ -17,55 +19,107 @@
 #include <jack/midiport.h>
 
 static volatile sig_atomic_t QuitFlag = false;
+static volatile sig_atomic_t ReportFlag = false;
 volatile int ExitSignal = 0;
 static MIDIeventhandler *evh;
 static jack_port_t *output_port[2];
-static jack_port_t *midi_port;
+static jack_port_t *card_port[2][MaxCards];
+static jack_port_t *midi_port[MaxMIDIPorts];
 static jack_client_t *client;
+static unsigned int jack_rate;
+static CallbackMonitor callback_monitor;
 
 static inline void write_samples(float *out[2], jack_nframes_t offset, jack_nframes_t count)
 {
-    float outbuf[MaxSamplesAtTime*2];
+    // Update adds in samples, so initialize to zero
+    memset(out[0] + offset, 0, count*sizeof(float));
+    memset(out[1] + offset, 0, count*sizeof(float));
     while (count > 0) // Some of the underlying synths are limited to 512 samples at a time
     {
         jack_nframes_t n_samples = std::min(count, MaxSamplesAtTime);
-        // Update adds in samples, so initialize to zero
-        memset(outbuf, 0, n_samples*2*sizeof(float));
-        evh->Update(outbuf, n_samples);
-        for(unsigned a = 0; a < n_samples; ++a)
-        {
-            out[0][offset + a] = outbuf[a*2+0];
-            out[1][offset + a] = outbuf[a*2+1];
-        }
+        evh->UpdatePlanar(out[0] + offset, out[1] + offset, n_samples);
         count -= n_samples;
         offset += n_samples;
     }
 }
 
+// Render every card into its own ports, and mix them into out if there is a master mix
+static inline void write_card_samples(float *out[2], float **cards[2], jack_nframes_t offset, jack_nframes_t count)
+{
+    float *left[MaxCards], *right[MaxCards];
+    for(unsigned card = 0; card < NumCards; ++card)
+    {
+        memset(cards[0][card] + offset, 0, count*sizeof(float));
+        memset(cards[1][card] + offset, 0, count*sizeof(float));
+    }
+    for(jack_nframes_t pos = offset, left_over = count; left_over > 0; )
+    {
+        jack_nframes_t n_samples = std::min(left_over, MaxSamplesAtTime);
+        for(unsigned card = 0; card < NumCards; ++card)
+        {
+            left[card] = cards[0][card] + pos;
+            right[card] = cards[1][card] + pos;
+        }
+        evh->RenderCards(left, right, n_samples);
+        left_over -= n_samples;
+        pos += n_samples;
+    }
+    if(!MasterMix)
+        return;
+    for(unsigned w = 0; w < 2; ++w)
+    {
+        memcpy(out[w] + offset, cards[w][0] + offset, count*sizeof(float));
+        for(unsigned card = 1; card < NumCards; ++card)
+            for(jack_nframes_t a = offset; a < offset + count; ++a)
+                out[w][a] += cards[w][card][a];
+    }
+}
+
 // JACK audio callback
 static int JACK_AudioCallback(jack_nframes_t nframes, void *)
 {
-    float *out[2] = {(jack_default_audio_sample_t *) jack_port_get_buffer(output_port[0], nframes),
-                     (jack_default_audio_sample_t *) jack_port_get_buffer(output_port[1], nframes)};
+    uint64_t start = callback_monitor.Begin();
+    float *out[2] = {0, 0};
+    if(MasterMix)
+    {
+        out[0] = (jack_default_audio_sample_t *) jack_port_get_buffer(output_port[0], nframes);
+        out[1] = (jack_default_audio_sample_t *) jack_port_get_buffer(output_port[1], nframes);
+    }
+    float *card_out[2][MaxCards];
+    float **cards[2] = {card_out[0], card_out[1]};
+    if(CardOutputs)
+        for(unsigned w = 0; w < 2; ++w)
+            for(unsigned card = 0; card < NumCards; ++card)
+                card_out[w][card] = (jack_default_audio_sample_t *) jack_port_get_buffer(card_port[w][card], nframes);
     jack_nframes_t offset = 0;
-    jack_nframes_t event_idx = 0;
-    void *midi_buf = jack_port_get_buffer(midi_port, nframes);
-    jack_nframes_t event_count = jack_midi_get_event_count(midi_buf);
+    // Events from all ports, in timestamp order
+    JackMIDIMerge events(midi_port, NumMIDIPorts, nframes);
+    jack_midi_event_t in_event;
+    unsigned port;
 
-    for(event_idx=0; event_idx<event_count; ++event_idx)
+    while(events.Next(&in_event, &port))
     {
-        jack_midi_event_t in_event;
-        jack_midi_event_get(&in_event, midi_buf, event_idx);
-
-        write_samples(out, offset, in_event.time - offset);
+        if(CardOutputs)
+            write_card_samples(out, cards, offset, in_event.time - offset);
+        else
+            write_samples(out, offset, in_event.time - offset);
         offset = in_event.time;
 
-        evh->HandleEvent(0, in_event.buffer, in_event.size);
+        evh->HandleEvent(port, in_event.buffer, in_event.size);
     }
-    write_samples(out, offset, nframes - offset);
+    if(CardOutputs)
+        write_card_samples(out, cards, offset, nframes - offset);
+    else
+        write_samples(out, offset, nframes - offset);
+    callback_monitor.End(start, nframes, jack_rate);
     return 0;
 }
 
+static int JACK_XrunCallback(void *)
+{
+    callback_monitor.CountXrun();
+    return 0;
+}
 static void JACK_ShutdownCallback(void *)
 {
     QuitFlag = true;
@@ -75,6 +129,10 @@ static void TidyupAndExit(int signal)
     QuitFlag = true;
     ExitSignal = signal;
 }
+static void RequestReport(int)
+{
+    ReportFlag = true;
+}
 
 /// Connect to jack server and create ports
 void InitializeAudio()
@@ -96,11 +154,12 @@ void InitializeAudio()
         InitMessage(-1, "unique name `%s' assigned\n", jack_get_client_name(client));
     }
     jack_set_process_callback(client, JACK_AudioCallback, 0);
+    jack_set_xrun_callback(client, JACK_XrunCallback, 0);
     jack_on_shutdown(client, JACK_ShutdownCallback, 0);
 
     // create two ports, for stereo audio
     const char * const portnames[] = { "out_1", "out_2" };
-    for(int port=0; port<2; ++port)
+    for(int port=0; port<2 && MasterMix; ++port)
     {
         output_port[port] = jack_port_register(client, portnames[port],
                                          JACK_DEFAULT_AUDIO_TYPE,
@@ -110,13 +169,36 @@ void InitializeAudio()
             exit(1);
         }
     }
+    // and two for every card, if wanted
+    for(unsigned card=0; card<NumCards && CardOutputs; ++card)
+    {
+        for(int port=0; port<2; ++port)
+        {
+            char portname[32];
+            std::snprintf(portname, sizeof(portname), "card_%u_%s", card + 1, port ? "R" : "L");
+            card_port[port][card] = jack_port_register(client, portname,
+                                             JACK_DEFAULT_AUDIO_TYPE,
+                                             JackPortIsOutput, 0);
+            if (card_port[port][card] == NULL) {
+                InitMessage(-1, "no more JACK ports available\n");
+                exit(1);
+            }
+        }
+    }
 
-    midi_port = jack_port_register(client, "midi_in",
-                                 JACK_DEFAULT_MIDI_TYPE,
-                                 JackPortIsInput, 0);
-    if (midi_port == NULL) {
-        InitMessage(-1, "no more JACK midi ports available\n");
-        exit(1);
+    for(unsigned port=0; port<NumMIDIPorts; ++port)
+    {
+        // A single input keeps its old name
+        char portname[16] = "midi_in";
+        if(NumMIDIPorts > 1)
+            std::snprintf(portname, sizeof(portname), "midi_in_%u", port + 1);
+        midi_port[port] = jack_port_register(client, portname,
+                                     JACK_DEFAULT_MIDI_TYPE,
+                                     JackPortIsInput, 0);
+        if (midi_port[port] == NULL) {
+            InitMessage(-1, "no more JACK midi ports available\n");
+            exit(1);
+        }
     }
 }
 
@@ -135,7 +217,7 @@ void StartAudio()
         InitMessage(-1, "JACK: no physical playback ports\n");
     }
 
-    for(int port=0; port<2; ++port)
+    for(int port=0; port<2 && MasterMix; ++port)
     {
         if (jack_connect(client, jack_port_name(output_port[port]), ports[port])) {
             InitMessage(-1, "JACK: cannot connect output ports\n");
@@ -147,9 +229,13 @@ void StartAudio()
 void ShutdownAudio()
 {
     jack_deactivate(client);
-    for(int port=0; port<2; ++port)
+    for(int port=0; port<2 && MasterMix; ++port)
         jack_port_unregister(client, output_port[port]);
-    jack_port_unregister(client, midi_port);
+    for(unsigned card=0; card<NumCards && CardOutputs; ++card)
+        for(int port=0; port<2; ++port)
+            jack_port_unregister(client, card_port[port][card]);
+    for(unsigned port=0; port<NumMIDIPorts; ++port)
+        jack_port_unregister(client, midi_port[port]);
     jack_client_close(client);
 }
 
@@ -160,8 +246,8 @@ public:
 
     void PrintLn(const char* fmt, ...) __attribute__((format(printf,2,3))) {}
     void IllustrateNote(int adlchn, int note, int ins, int pressure, double bend) {}
-    void IllustrateVolumes(double left, double right) {}
     void IllustratePatchChange(int MidCh, int patch, int adlinsid) {}
+    void Log(LogMessage msg, int a, int b, int c, int d, const char *text) {}
 };
 
 int main(int argc, char** argv)
@@ -171,10 +257,13 @@ int main(int argc, char** argv)
 
     signal(SIGTERM, TidyupAndExit);
     signal(SIGINT, TidyupAndExit);
+    signal(SIGUSR1, RequestReport);
 
     int rv = ParseArguments(argc, argv);
     if(rv >= 0)
         return rv;
+    if(!CardOutputs)
+        MasterMix = true; // Without stems the mix is the only output
     InitializeAudio();
 
 #if 1
@@ -183,21 +272,34 @@ int main(int argc, char** argv)
     UIInterface *ui = new DummyUI();
 #endif
 
-    unsigned int jack_rate = (unsigned int)jack_get_sample_rate(client);
+    jack_rate = (unsigned int)jack_get_sample_rate(client);
     evh = new MIDIeventhandler(jack_rate, ui);
     evh->Reset();
+    evh->SetNumPorts(NumMIDIPorts);
 
     StartAudio();
     /// XXX use a condition flag
+    char summary[256];
     while(!QuitFlag)
+    {
         sleep(1);
+        if(ReportFlag)
+        {
+            ReportFlag = false;
+            callback_monitor.Summary(summary, sizeof(summary));
+            InitMessage(-1, "%s\n", summary); // DummyUI prints nothing
+        }
+    }
 
     ShutdownAudio();
 
     delete ui; ui = 0;
+    callback_monitor.Summary(summary, sizeof(summary));
+    InitMessage(-1, "%s\n", summary);
 
     signal(SIGTERM, SIG_DFL);
     signal(SIGINT, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
     if(ExitSignal)
         raise(ExitSignal);
     return 0;
@@ -19,6 +19,9 @@
 #include <unistd.h>
 #include <vector>
 
+// Frequency of OPL channel level updates in UI
+#define CHANNEL_METER_FREQ 30
+
 static const char PercussionMap[256] =
 "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"//GM
 "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0" // 3 = bass drum
@@ -40,6 +43,10 @@ static const char PercussionMap[256] =
 "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
 "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
 
+unsigned PercussionCategory(unsigned midiins)
+{
+    return PercussionMap[midiins & 0xFF];
+}
 
 static const unsigned short Operators[23*2] =
     {0x000,0x003,0x001,0x004,0x002,0x005, // operators  0, 3,  1, 4,  2, 5
@@ -373,14 +380,37 @@ void OPL3IF::Reset(OPLEmuType emutype, unsigned int sample_rate, bool fullpan)
     Silence();
 }
 
-void OPL3IF::Update(float *buffer, int length)
+void OPL3IF::Render(float *left, float *right, int step, int length)
 {
     for(unsigned card = 0; card < cards.size(); ++card)
     {
-        cards[card]->Update(buffer, length);
+        cards[card]->Render(left, right, step, length);
     }
 }
 
+void OPL3IF::RenderCard(unsigned card, float *left, float *right, int step, int length)
+{
+    cards[card]->Render(left, right, step, length);
+}
+
+bool OPL3IF::RenderChannels(float *left, float *right, int step, int length, float *channels)
+{
+    // All cards run the same emulator, so the first one tells
+    for(unsigned card = 0; card < cards.size(); ++card)
+        if(!cards[card]->RenderChannels(left, right, step, length,
+                                        channels + card * OPLEmul::NumChannels * length))
+            return false;
+    return true;
+}
+
+bool OPL3IF::IsSilent() const
+{
+    for(unsigned card = 0; card < cards.size(); ++card)
+        if(!cards[card]->IsSilent())
+            return false;
+    return true;
+}
+
 MIDIeventhandler::MIDIchannel::MIDIchannel()
             : portamento(0),
               bank_lsb(0), bank_msb(0), patch(0),
@@ -762,8 +792,7 @@ void MIDIeventhandler::SetRPN(unsigned MidCh, unsigned value, bool MSB)
                 value ? long(0.2092 * std::exp(0.0795 * value)) : 0.0;
             break;
 
-        default: ui->PrintLn("%s %04X <- %d (%cSB) (ch %u)",
-            "NRPN"+!nrpn, addr, value, "LM"[MSB], MidCh);
+        default: ui->Log(nrpn ? LOG_NRPN : LOG_RPN, addr, value, "LM"[MSB], MidCh);
     }
 }
 
@@ -775,7 +804,7 @@ void MIDIeventhandler::UpdatePortamento(unsigned MidCh)
     NoteUpdate_All(MidCh, Upd_Pitch);
     */
     if(Ch[MidCh].portamento)
-        ui->PrintLn("Portamento %u: %u (unimplemented)", MidCh, Ch[MidCh].portamento);
+        ui->Log(LOG_PORTAMENTO, MidCh, Ch[MidCh].portamento);
 }
 
 void MIDIeventhandler::NoteUpdate_All(unsigned MidCh, unsigned props_mask)
@@ -879,9 +908,7 @@ int MIDIeventhandler::GetBank(int MidCh)
                 i = bank_warnings.lower_bound(bankid);
             if(i == bank_warnings.end() || *i != bankid)
             {
-                ui->PrintLn("[%u]Bank %u undefined",
-                    MidCh,
-                    Ch[MidCh].bank_msb);
+                ui->Log(LOG_BANK_UNDEFINED, MidCh, Ch[MidCh].bank_msb);
                 bank_warnings.insert(i, bankid);
             }
         }
@@ -892,9 +919,7 @@ int MIDIeventhandler::GetBank(int MidCh)
                 i = bank_warnings.lower_bound(bankid);
             if(i == bank_warnings.end() || *i != bankid)
             {
-                ui->PrintLn("[%u]Bank lsb %u undefined",
-                    MidCh,
-                    Ch[MidCh].bank_lsb);
+                ui->Log(LOG_BANK_LSB_UNDEFINED, MidCh, Ch[MidCh].bank_lsb);
                 bank_warnings.insert(i, bankid);
             }
         }
@@ -950,7 +975,7 @@ void MIDIeventhandler::NoteOn(int MidCh, int note, int vol)
     static std::set<unsigned char> missing_warnings;
     if(!missing_warnings.count(midiins) && (adlins[meta].flags & adlinsdata::Flag_NoSound))
     {
-        ui->PrintLn("[%i]Playing missing instrument %i", MidCh, midiins);
+        ui->Log(LOG_MISSING_INSTRUMENT, MidCh, midiins);
         missing_warnings.insert(midiins);
     }
 
@@ -1059,9 +1084,9 @@ void MIDIeventhandler::ControllerChange(int MidCh, int ctrlno, int value)
             if(AllowBankSwitch)
             {
                 if(value >= 0 && value < (int)NumBanks)
-                    ui->PrintLn("[%u] Using bank %d '%s'", MidCh, value, banknames[value]);
+                    ui->Log(LOG_USING_BANK, MidCh, value, 0, 0, banknames[value]);
                 else
-                    ui->PrintLn("[%u] Using undefined bank %d", MidCh, value);
+                    ui->Log(LOG_USING_UNDEFINED_BANK, MidCh, value);
             }
             Ch[MidCh].bank_lsb = value;
             break;
@@ -1129,7 +1154,7 @@ void MIDIeventhandler::ControllerChange(int MidCh, int ctrlno, int value)
         case  6: SetRPN(MidCh, value, true); break;
         case 38: SetRPN(MidCh, value, false); break;
         default:
-            ui->PrintLn("Ctrl %d <- %d (ch %u)", ctrlno, value, MidCh);
+            ui->Log(LOG_CONTROLLER, ctrlno, value, MidCh);
     }
 }
 
@@ -1167,7 +1192,7 @@ void MIDIeventhandler::HandleEvent(int port, const unsigned char *data, unsigned
     unsigned byte = data[0];
     if(byte == 0xF7 || byte == 0xF0) // Ignore SysEx
     {
-        ui->PrintLn("SysEx %02X: %u bytes", byte, length);
+        ui->Log(LOG_SYSEX, byte, length);
         return;
     }
     unsigned MidCh = port * 16 + (byte & 0x0F), EvType = byte >> 4;
@@ -1229,6 +1254,30 @@ void MIDIeventhandler::Reset()
     ch.resize(opl.NumChannels);
     Ch.clear();
     SetNumPorts(1);
+
+    channel_meters = ChannelMeters;
+    channel_output.assign(opl.CardCount() * OPLEmul::NumChannels * MaxSamplesAtTime, 0.0f);
+    channel_energy.assign(opl.CardCount() * OPLEmul::NumChannels, 0.0);
+    channel_levels.assign(opl.NumChannels, 0.0f);
+    channel_frames = 0;
+}
+
+/* Key off all notes and reset the MIDI channels to their initial state,
+ * without resetting the OPL. Notes that were playing release normally.
+ */
+void MIDIeventhandler::ResetChannels()
+{
+    for(unsigned MidCh = 0; MidCh < Ch.size(); ++MidCh)
+    {
+        Ch[MidCh].sustain = 0;
+        NoteUpdate_All(MidCh, Upd_Off);
+    }
+    KillSustainingNotes();
+    for(unsigned MidCh = 0; MidCh < Ch.size(); ++MidCh)
+    {
+        Ch[MidCh] = MIDIchannel();
+        ui->IllustratePatchChange(MidCh, -1, -1);
+    }
 }
 
 void MIDIeventhandler::Tick(double s)
@@ -1248,14 +1297,69 @@ void MIDIeventhandler::SetNumPorts(int ports)
         ui->IllustratePatchChange(ch, -1, -1);
 }
 
-void MIDIeventhandler::Update(float *buffer, int length)
+void MIDIeventhandler::Render(float *left, float *right, int step, int length)
+{
+    if(channel_meters && opl.RenderChannels(left, right, step, length, &channel_output[0]))
+        MeasureChannels(length);
+    else
+    {
+        if(channel_meters)
+        {
+            ui->PrintLn("This OPL emulator cannot measure its channels");
+            channel_meters = false;
+        }
+        opl.Render(left, right, step, length);
+    }
+    Tick(length / (double)sample_rate);
+}
+
+/* Add up the energy of every OPL channel in the block just rendered,
+ * and pass the levels on to the UI a few times per second.
+ */
+void MIDIeventhandler::MeasureChannels(int length)
+{
+    for(unsigned c = 0; c < channel_energy.size(); ++c)
+    {
+        const float *out = &channel_output[c * length];
+        double sum = 0;
+        for(int i = 0; i < length; ++i)
+            sum += out[i] * out[i];
+        channel_energy[c] += sum;
+    }
+    channel_frames += length;
+    if(channel_frames < sample_rate / CHANNEL_METER_FREQ)
+        return;
+
+    // The percussion channels 18..22 sound on the rhythm channels 6..8
+    static const unsigned char rhythm_channel[5] = {6, 7, 8, 8, 7}; // BD SD TT CY HH
+    for(unsigned c = 0; c < opl.NumChannels; ++c)
+    {
+        unsigned card = c / 23, n = c % 23;
+        if(n >= 18 && !AdlPercussionMode)
+        {
+            channel_levels[c] = 0;
+            continue;
+        }
+        if(n >= 18)
+            n = rhythm_channel[n - 18];
+        const double energy = channel_energy[card * OPLEmul::NumChannels + n];
+        channel_levels[c] = std::sqrt(energy / channel_frames) * SAMPLE_MULT_OUTPUT_FLOAT;
+    }
+    std::fill(channel_energy.begin(), channel_energy.end(), 0.0);
+    channel_frames = 0;
+    ui->IllustrateChannelLevels(&channel_levels[0], channel_levels.size());
+}
+
+void MIDIeventhandler::RenderCards(float * const *left, float * const *right, int length)
 {
-    opl.Update(buffer, length);
+    for(unsigned card = 0; card < opl.CardCount(); ++card)
+        opl.RenderCard(card, left[card], right[card], 1, length);
     Tick(length / (double)sample_rate);
 }
 
 MIDIeventhandler::MIDIeventhandler(unsigned int sample_rate, UIInterface *ui):
-    sample_rate(sample_rate), ui(ui), opl(ui)
+    sample_rate(sample_rate), ui(ui), opl(ui),
+    channel_meters(false), channel_frames(0)
 {
 }
 
@@ -42,7 +42,13 @@ public:
     void Pan(unsigned c, unsigned value);
     void Silence();
     void Reset(OPLEmuType emutype, unsigned int sample_rate, bool fullpan);
-    void Update(float *buffer, int length);
+    void Render(float *left, float *right, int step, int length);
+    void RenderCard(unsigned card, float *left, float *right, int step, int length);
+    // Render, and also write the output of every OPL channel of every card,
+    // card after card, to channels. See OPLEmul::RenderChannels.
+    bool RenderChannels(float *left, float *right, int step, int length, float *channels);
+    unsigned CardCount() const { return cards.size(); }
+    bool IsSilent() const;
 };
 
 // Return length of midi event, excluding first byte
@@ -68,6 +74,10 @@ static inline unsigned MidiEventLength(unsigned char byte)
     return 1;
 }
 
+// Percussion channel category (3..7, see four_op_category) used for
+// instrument midiins in AdlPercussionMode, or 0 for a melodic channel.
+unsigned PercussionCategory(unsigned midiins);
+
 // Process MIDI events and send them to OPL
 class MIDIeventhandler
 {
@@ -141,6 +151,13 @@ private:
     unsigned int sample_rate;
     UIInterface *ui;
     OPL3IF opl;
+
+    // Measured output of every OPL channel, with ChannelMeters
+    bool channel_meters;
+    std::vector<float> channel_output;  // One block of every OPL channel
+    std::vector<double> channel_energy; // Per OPL channel since the last report
+    std::vector<float> channel_levels;  // Per adlchn, as reported to the UI
+    unsigned long channel_frames;
     enum { Upd_Patch  = 0x1,
            Upd_Pan    = 0x2,
            Upd_Volume = 0x4,
@@ -172,6 +189,7 @@ private:
     void UpdateArpeggio(double /*amount*/);
     int GetBank(int MidCh);
     void Tick(double s);
+    void MeasureChannels(int length);
 
     // Specific MIDI Event handlers
     void NoteOff(unsigned MidCh, int note);
@@ -186,7 +204,17 @@ public:
     void HandleEvent(int port, const unsigned char *data, unsigned length);
     void SetNumPorts(int channels);
     void Reset();
-    void Update(float *buffer, int length);
+    void ResetChannels();
+    // Add length stereo samples to left and right, each step floats apart
+    void Render(float *left, float *right, int step, int length);
+    // Add length samples to an interleaved stereo buffer
+    void Update(float *buffer, int length) { Render(buffer, buffer+1, 2, length); }
+    // Add length samples to separate left and right buffers
+    void UpdatePlanar(float *left, float *right, int length) { Render(left, right, 1, length); }
+    // Add length samples of each card c to its own buffers left[c] and right[c]
+    void RenderCards(float * const *left, float * const *right, int length);
+    // True once all OPL envelopes have released to silence
+    bool IsSilent() const { return opl.IsSilent(); }
 };
 
 #endif
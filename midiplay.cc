@@ -4,27 +4,269 @@
 #include "fraction"
 #include "midievt.hh"
 #include "parseargs.hh"
+#include "qtui.hh"
 #include "sync.hh"
 #include "ui.hh"
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <climits>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <deque>
+#include <dirent.h>
 #include <map>
+#include <queue>
 #include <set>
 #include <signal.h>
 #include <stdarg.h>
 #include <string>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
 volatile sig_atomic_t QuitFlag = false;
+static volatile sig_atomic_t ReportFlag = false;
 volatile int ExitSignal = 0;
 unsigned SkipForward = 0;
 
+/** Receives what happens in a song when MIDIplay walks through it
+ * without synthesis. Times are in seconds from the first note.
+ */
+class SongListener
+{
+public:
+    virtual ~SongListener() { }
+    virtual void HandleEvent(double time, int port, const unsigned char *data, unsigned length) = 0;
+    virtual void TempoChange(double /*time*/, double /*bpm*/) { }
+    virtual void LoopStart(double /*time*/) { }
+    virtual void SongEnd(double /*time*/) { }
+};
+
+/** Find out how many OPL voices of each kind a song needs at most,
+ * by following its note events without synthesizing anything.
+ * The instrument choice mirrors MIDIeventhandler::NoteOn.
+ */
+class VoiceAnalyzer: public SongListener
+{
+public:
+    enum Kind { TwoOp, FourOp, Percussion, NumKinds = Percussion + 5 };
+    unsigned peak[NumKinds];
+
+    VoiceAnalyzer(): Ch()
+    {
+        for(unsigned k=0; k<NumKinds; ++k) peak[k] = current[k] = 0;
+    }
+
+    void HandleEvent(double /*time*/, int port, const unsigned char *data, unsigned length)
+    {
+        if(length == 0 || data[0] < 0x80 || data[0] >= 0xF0 || length < MidiEventLength(data[0]))
+            return;
+        unsigned MidCh = port * 16 + (data[0] & 0x0F);
+        if(MidCh >= Ch.size())
+            Ch.resize(MidCh + 1);
+        MIDIchannel& c = Ch[MidCh];
+        switch(data[0] >> 4)
+        {
+            case 0x8: NoteOff(MidCh, data[1]); break;
+            case 0x9:
+                NoteOff(MidCh, data[1]);
+                if(data[2]) NoteOn(MidCh, data[1]);
+                break;
+            case 0xB:
+                switch(data[1])
+                {
+                    case 32: c.bank_lsb = data[2]; break;
+                    case 64:
+                        c.sustain = data[2];
+                        if(!c.sustain) Release(c.sustained);
+                        break;
+                    case 120: case 123:
+                        for(MIDIchannel::notemap_t::iterator i = c.notes.begin(); i != c.notes.end(); ++i)
+                            c.sustained.push_back(i->second);
+                        c.notes.clear();
+                        if(data[1] == 120 || !c.sustain) Release(c.sustained);
+                        break;
+                    case 121:
+                        c.sustain = 0;
+                        Release(c.sustained);
+                        break;
+                }
+                break;
+            case 0xC: c.patch = data[1]; break;
+        }
+    }
+
+    /* Smallest card and four-op count that plays every note
+     * without stealing or sharing a channel. */
+    void ChooseConfiguration(unsigned &cards, unsigned &fourops) const
+    {
+        const unsigned chans_per_card = AdlPercussionMode ? 15 : 18;
+        fourops = peak[FourOp];
+        cards = std::max(1u, (fourops + 5) / 6);
+        cards = std::max(cards, (peak[TwoOp] + 2*fourops + chans_per_card - 1) / chans_per_card);
+        for(unsigned k=Percussion; k<NumKinds; ++k)
+            cards = std::max(cards, peak[k]);
+        cards = std::min(cards, MaxCards);
+        fourops = std::min(fourops, 6 * cards);
+    }
+private:
+    struct Voice { unsigned char kind, units; };
+    struct MIDIchannel
+    {
+        unsigned char patch, bank_lsb, sustain;
+        typedef std::map<unsigned char/*note*/, Voice> notemap_t;
+        notemap_t notes;
+        std::vector<Voice> sustained; // keyed off, but still holding a channel
+
+        MIDIchannel(): patch(0), bank_lsb(AllowBankSwitch ? AdlBank : 0), sustain(0) { }
+    };
+    std::vector<MIDIchannel> Ch;
+    unsigned current[NumKinds];
+
+    void NoteOn(unsigned MidCh, unsigned note)
+    {
+        MIDIchannel& c = Ch[MidCh];
+        unsigned midiins = c.patch;
+        if(MidCh%16 == 9) midiins = 128 + note; // Percussion instrument
+        unsigned bank = AllowBankSwitch ? c.bank_lsb : AdlBank;
+        if(bank >= NumBanks) bank = 0;
+        const adlinsdata& ins = adlins[banks[bank][midiins]];
+
+        Voice v;
+        v.units = 1;
+        if(AdlPercussionMode && PercussionCategory(midiins))
+            v.kind = Percussion + PercussionCategory(midiins) - 3;
+        else if(ins.adlno1 == ins.adlno2)
+            v.kind = TwoOp;
+        else if(ins.flags & adlinsdata::Flag_Pseudo4op)
+            { v.kind = TwoOp; v.units = 2; }
+        else
+            v.kind = FourOp;
+        c.notes[note] = v;
+        current[v.kind] += v.units;
+        peak[v.kind] = std::max(peak[v.kind], current[v.kind]);
+    }
+    void NoteOff(unsigned MidCh, unsigned note)
+    {
+        MIDIchannel& c = Ch[MidCh];
+        MIDIchannel::notemap_t::iterator i = c.notes.find(note);
+        if(i == c.notes.end())
+            return;
+        if(c.sustain)
+            c.sustained.push_back(i->second);
+        else
+            current[i->second.kind] -= i->second.units;
+        c.notes.erase(i);
+    }
+    void Release(std::vector<Voice>& voices)
+    {
+        for(size_t a=0; a<voices.size(); ++a)
+            current[voices[a].kind] -= voices[a].units;
+        voices.clear();
+    }
+};
+
+/** Collect the length, loop points, tempo map and instruments of a song.
+ */
+class SongScanner: public SongListener
+{
+public:
+    double length;     // Playing time until the song first ends or loops
+    double loop_start; // Where playback resumes when looping
+    std::vector< std::pair<double, double> > tempos; // (time, bpm)
+    std::set<unsigned> programs;   // Melodic programs that play notes
+    std::set<unsigned> percussion; // Notes played on the percussion channel
+
+    SongScanner(): length(0), loop_start(0), ended(false)
+    {
+        for(unsigned a=0; a<16; ++a) patch[a] = 0;
+    }
+
+    void HandleEvent(double /*time*/, int /*port*/, const unsigned char *data, unsigned length)
+    {
+        if(ended || length < MidiEventLength(data[0]))
+            return;
+        unsigned MidCh = data[0] & 0x0F;
+        switch(data[0] >> 4)
+        {
+            case 0x9:
+                if(!data[2]) break;
+                if(MidCh == 9)
+                    percussion.insert(data[1]);
+                else
+                    programs.insert(patch[MidCh]);
+                break;
+            case 0xC: patch[MidCh] = data[1]; break;
+        }
+    }
+    void TempoChange(double time, double bpm)
+    {
+        if(ended) return;
+        // Several tempo events at the same time replace each other
+        if(!tempos.empty() && tempos.back().first == time)
+            tempos.pop_back();
+        if(tempos.empty() || tempos.back().second != bpm)
+            tempos.push_back(std::make_pair(time, bpm));
+    }
+    void LoopStart(double time)
+    {
+        if(!ended) loop_start = time;
+    }
+    void SongEnd(double time)
+    {
+        if(!ended) length = time;
+        ended = true;
+    }
+    /* Playing time when looping the given number of times */
+    double LoopedLength(unsigned loops) const
+    {
+        return length + loops * (length - loop_start);
+    }
+private:
+    unsigned char patch[16];
+    bool ended;
+};
+
+class MIDIplay;
+
+/** Parse the songs of a playlist on a background thread, one song ahead
+ * of playback, so that the player can switch to the next song without
+ * a gap when the current one ends.
+ */
+class PlaylistLoader
+{
+public:
+    PlaylistLoader(const std::vector<std::string>& files, UIInterface *ui);
+    ~PlaylistLoader();
+
+    /* Start parsing the first song */
+    void Start();
+    /* Called from the audio thread at the end of a song. Switches player
+     * to the next song if it has been parsed already.
+     */
+    bool TakeNext(MIDIplay& player);
+    /* Return true if there are no more songs to play */
+    bool Finished() const { return state == Done; }
+private:
+    enum State { Loading, Ready, Done };
+    std::vector<std::string> files;
+    size_t next_file, ready_file;
+    MIDIplay *song;
+    UIInterface *ui;
+    std::atomic<int> state;
+    volatile bool terminate;
+    SemaphoreType wakeup;
+    SDL_Thread *thread;
+
+    void Run();
+
+    friend int PlaylistThread(void*);
+};
+
 // Read midi file and play back events
 class MIDIplay
 {
@@ -52,12 +294,19 @@ private:
     std::map<unsigned/*track*/, unsigned/*port index*/> current_device;
 
     fraction<long> InvDeltaTicks, Tempo;
-    bool loopStart, loopEnd;
+    bool loopStart, loopEnd, songEnded;
+    unsigned loopsPlayed;
+    bool stopped, fadeRequested;
+    bool waitingForNext; // Ended, the next song of the playlist is not parsed yet
     MIDIeventhandler *evh;
+    SongListener *listener; // Receives the events instead of evh while walking the song
+    double walkTime;
+    PlaylistLoader *playlist;
     UIInterface *ui;
 public:
     explicit MIDIplay(MIDIeventhandler *evh, UIInterface *ui):
-        evh(evh), ui(ui)
+        loopsPlayed(0), stopped(false), fadeRequested(false), waitingForNext(false),
+        evh(evh), listener(NULL), walkTime(0), playlist(NULL), ui(ui)
     {
     }
 
@@ -80,9 +329,212 @@ public:
         }
         return result;
     }
+    static unsigned long ReadVarLen(const std::vector<unsigned char>& data, size_t& p, size_t end)
+    {
+        unsigned long result = 0;
+        while(p < end)
+        {
+            unsigned char byte = data[p++];
+            result = (result << 7) + (byte & 0x7F);
+            if(!(byte & 0x80)) break;
+        }
+        return result;
+    }
+    static void WriteVarLen(std::vector<unsigned char>& out, unsigned long value)
+    {
+        if(value>>21) out.push_back( 0x80 | ((value>>21) & 0x7F ) );
+        if(value>>14) out.push_back( 0x80 | ((value>>14) & 0x7F ) );
+        if(value>> 7) out.push_back( 0x80 | ((value>> 7) & 0x7F ) );
+        out.push_back( ((value>>0) & 0x7F ) );
+    }
 
-    bool LoadMIDI(const std::string& filename)
+    /* Locate the EVNT chunk of the given sequence in an XMIDI file.
+     * The file is either a single FORM XMID, or a FORM XDIR followed by
+     * a CAT XMID containing one FORM XMID per sequence.
+     * Returns the number of sequences found.
+     */
+    static unsigned FindXMIEvents(const std::vector<unsigned char>& data, unsigned sequence,
+                                  size_t& evnt_begin, size_t& evnt_end)
+    {
+        unsigned count = 0;
+        size_t pos = 0;
+        while(pos + 8 <= data.size())
+        {
+            const unsigned char *id = &data[pos];
+            size_t end = std::min(pos + 8 + ReadBEInt(&data[pos+4], 4), data.size());
+            if((std::memcmp(id, "FORM", 4) == 0 || std::memcmp(id, "CAT ", 4) == 0)
+            && pos + 12 <= end)
+            {
+                if(std::memcmp(id, "FORM", 4) == 0 && std::memcmp(&data[pos+8], "XMID", 4) == 0)
+                {
+                    if(count == sequence)
+                    {
+                        for(size_t sub = pos + 12; sub + 8 <= end; )
+                        {
+                            size_t sub_end = std::min(sub + 8 + ReadBEInt(&data[sub+4], 4), end);
+                            if(std::memcmp(&data[sub], "EVNT", 4) == 0)
+                            {
+                                evnt_begin = sub + 8;
+                                evnt_end   = sub_end;
+                            }
+                            sub = sub_end + ((sub_end - sub) & 1);
+                        }
+                    }
+                    ++count;
+                }
+                else
+                {
+                    // Descend into the container (XDIR info, CAT of sequences)
+                    pos += 12;
+                    continue;
+                }
+            }
+            pos = end + ((end - pos) & 1);
+        }
+        return count;
+    }
+
+    /* Convert an XMIDI event stream into a single regular MIDI track.
+     * XMIDI differs from SMF in three ways:
+     *  - delays are sums of bytes below 0x80 instead of variable-length numbers
+     *  - note-ons carry their duration; there are no note-off events
+     *  - timing is fixed at 120 Hz, tempo events are only informational
+     * Note-offs are synthesized here, at load time, so that the result is an
+     * ordinary, pre-sorted event stream for ProcessEvents().
+     */
+    static void ConvertXMI(const std::vector<unsigned char>& data, size_t begin, size_t end,
+                           std::vector<unsigned char>& track)
     {
+        struct NoteOff
+        {
+            unsigned long time;
+            unsigned long order; // Keep note-offs at equal times in insertion order
+            unsigned char status, note;
+            bool operator< (const NoteOff& b) const
+                { return time > b.time || (time == b.time && order > b.order); }
+        };
+        std::priority_queue<NoteOff> pending;
+        unsigned long time = 0, written = 0, order = 0;
+        unsigned loop_depth = 0;
+
+        for(size_t p = begin; p < end; )
+        {
+            unsigned char byte = data[p++];
+            if(byte < 0x80)
+            {
+                time += byte;
+                continue;
+            }
+            // Emit note-offs that are due before this event
+            while(!pending.empty() && pending.top().time <= time)
+            {
+                const NoteOff& off = pending.top();
+                WriteVarLen(track, off.time - written); written = off.time;
+                track.push_back(off.status);
+                track.push_back(off.note);
+                track.push_back(0x40);
+                pending.pop();
+            }
+
+            if(byte == 0xFF)
+            {
+                if(p >= end) break;
+                unsigned char evtype = data[p++];
+                unsigned long length = ReadVarLen(data, p, end);
+                if(evtype == 0x2F || p + length > end) break;
+                if(evtype != 0x51) // The 120 Hz timebase is fixed
+                {
+                    WriteVarLen(track, time - written); written = time;
+                    track.push_back(byte);
+                    track.push_back(evtype);
+                    WriteVarLen(track, length);
+                    track.insert(track.end(), data.begin() + p, data.begin() + p + length);
+                }
+                p += length;
+            }
+            else if(byte == 0xF0 || byte == 0xF7)
+            {
+                unsigned long length = ReadVarLen(data, p, end);
+                if(p + length > end) break;
+                WriteVarLen(track, time - written); written = time;
+                track.push_back(byte);
+                WriteVarLen(track, length);
+                track.insert(track.end(), data.begin() + p, data.begin() + p + length);
+                p += length;
+            }
+            else if(byte < 0xF0)
+            {
+                unsigned length = MidiEventLength(byte);
+                if(p + length - 1 > end) break;
+                const unsigned char *ev = &data[p];
+                p += length - 1;
+                if((byte & 0xF0) == 0x90)
+                {
+                    unsigned long duration = ReadVarLen(data, p, end);
+                    if(ev[1] != 0)
+                    {
+                        NoteOff off;
+                        off.time   = time + duration;
+                        off.order  = order++;
+                        off.status = 0x80 | (byte & 0x0F);
+                        off.note   = ev[0];
+                        pending.push(off);
+                    }
+                }
+                else if((byte & 0xF0) == 0xB0 && ev[0] >= 0x6E && ev[0] <= 0x78)
+                {
+                    // AIL-specific controllers. Translate the outermost
+                    // FOR/NEXT loop into loopStart/loopEnd markers, drop the rest.
+                    static const char loopStartTag[] = "loopStart", loopEndTag[] = "loopEnd";
+                    const char *marker = NULL;
+                    if(ev[0] == 0x74 && loop_depth++ == 0)
+                        marker = loopStartTag;
+                    else if(ev[0] == 0x75 && loop_depth > 0 && --loop_depth == 0)
+                        marker = loopEndTag;
+                    if(marker)
+                    {
+                        WriteVarLen(track, time - written); written = time;
+                        track.push_back(0xFF);
+                        track.push_back(0x06);
+                        WriteVarLen(track, std::strlen(marker));
+                        track.insert(track.end(), marker, marker + std::strlen(marker));
+                    }
+                    continue;
+                }
+                WriteVarLen(track, time - written); written = time;
+                track.push_back(byte);
+                track.insert(track.end(), ev, ev + length - 1);
+            }
+            else
+                break; // Not valid in XMIDI
+        }
+        // Release whatever is still sounding
+        while(!pending.empty())
+        {
+            const NoteOff& off = pending.top();
+            WriteVarLen(track, off.time - written); written = off.time;
+            track.push_back(off.status);
+            track.push_back(off.note);
+            track.push_back(0x40);
+            pending.pop();
+        }
+        static const unsigned char EndTag[4] = {0x00,0xFF,0x2F,0x00};
+        track.insert(track.end(), EndTag+0, EndTag+4);
+    }
+
+    /* Read a song into memory. This does not touch the MIDI event handler,
+     * so it can run on another thread while a song is playing.
+     */
+    bool ParseMIDI(const std::string& filename)
+    {
+        TrackData.clear();
+        CurrentPosition = Position();
+        LoopBeginPosition = Position();
+        current_device.clear();
+        loopsPlayed   = 0;
+        stopped       = false;
+        fadeRequested = false;
+
         std::FILE* fp = std::fopen(filename.c_str(), "rb");
         if(!fp) { std::perror(filename.c_str()); return false; }
         char HeaderBuf[4+4+2+2+2]="";
@@ -92,7 +544,7 @@ public:
             { std::fseek(fp, 6, SEEK_CUR); goto riffskip; }
         size_t DeltaTicks=192, TrackCount=1;
 
-        bool is_GMF = false, is_MUS = false, is_IMF = false;
+        bool is_GMF = false, is_MUS = false, is_IMF = false, is_XMI = false;
         std::vector<unsigned char> MUS_instrumentList;
 
         if(std::memcmp(HeaderBuf, "GMF\1", 4) == 0)
@@ -109,6 +561,13 @@ public:
             unsigned start = std::fgetc(fp); start += (std::fgetc(fp) << 8);
             std::fseek(fp, -8+start, SEEK_CUR);
         }
+        else if(std::memcmp(HeaderBuf, "FORM", 4) == 0
+             || std::memcmp(HeaderBuf, "CAT ", 4) == 0)
+        {
+            // XMIDI files (Miles Sound System)
+            is_XMI = true;
+            DeltaTicks = 120; // Fixed 120 Hz timebase at the default tempo
+        }
         else
         {
             // Try parsing as an IMF file
@@ -198,6 +657,29 @@ public:
                 CurrentPosition.began = true;
                 //std::fprintf(stderr, "Done reading IMF file\n");
             }
+            else if(is_XMI)
+            {
+                std::fseek(fp, 0, SEEK_END);
+                std::vector<unsigned char> data(std::ftell(fp));
+                std::rewind(fp);
+                data.resize(std::fread(&data[0], 1, data.size(), fp));
+
+                size_t evnt_begin = 0, evnt_end = 0;
+                unsigned n_sequences = FindXMIEvents(data, XMISequence, evnt_begin, evnt_end);
+                if(XMISequence >= n_sequences)
+                {
+                    std::fclose(fp);
+                    InitMessage(12, "%s: XMI sequence %u requested, file has %u\n",
+                        filename.c_str(), XMISequence, n_sequences);
+                    return false;
+                }
+                if(evnt_end <= evnt_begin) goto InvFmt;
+                if(ui) ui->PrintLn("XMI sequence %u of %u", XMISequence, n_sequences);
+
+                ConvertXMI(data, evnt_begin, evnt_end, TrackData[tk]);
+                // Read next event time
+                CurrentPosition.track[tk].delay = ReadVarLen(tk);
+            }
             else
             {
                 if(is_GMF)
@@ -231,7 +713,28 @@ public:
                 CurrentPosition.track[tk].delay = ReadVarLen(tk);
             }
         }
+        std::fclose(fp);
         loopStart = true;
+        return true;
+    }
+
+    bool LoadMIDI(const std::string& filename)
+    {
+        if(!ParseMIDI(filename))
+            return false;
+
+        if(AnalyzeSong)
+        {
+            VoiceAnalyzer voices;
+            WalkSong(voices);
+            voices.ChooseConfiguration(NumCards, NumFourOps);
+            ui->PrintLn("Peak voices: %u 2-op, %u 4-op, %u/%u/%u/%u/%u percussion",
+                voices.peak[VoiceAnalyzer::TwoOp], voices.peak[VoiceAnalyzer::FourOp],
+                voices.peak[VoiceAnalyzer::Percussion+0], voices.peak[VoiceAnalyzer::Percussion+1],
+                voices.peak[VoiceAnalyzer::Percussion+2], voices.peak[VoiceAnalyzer::Percussion+3],
+                voices.peak[VoiceAnalyzer::Percussion+4]);
+            ui->PrintLn("Using %u cards with %u four-op channels", NumCards, NumFourOps);
+        }
 
         evh->Reset();
         devices.clear();
@@ -240,6 +743,51 @@ public:
         return true;
     }
 
+    /* Read a song and walk through it, without using the event handler */
+    bool ScanMIDI(const std::string& filename, SongScanner& info)
+    {
+        if(!ParseMIDI(filename))
+            return false;
+        WalkSong(info);
+        return true;
+    }
+
+    /* Continue playback with the song parsed into next, at the current
+     * sample position. The MIDI channels are reset, but the OPL is not,
+     * so notes of the previous song ring out through their release.
+     * The previous song is handed back to next, to be freed off the
+     * audio thread.
+     */
+    void ContinueWith(MIDIplay& next)
+    {
+        double residual = CurrentPosition.wait;
+        TrackData.swap(next.TrackData);
+        std::swap(CurrentPosition, next.CurrentPosition);
+        std::swap(LoopBeginPosition, next.LoopBeginPosition);
+        current_device.swap(next.current_device);
+        InvDeltaTicks = next.InvDeltaTicks;
+        Tempo         = next.Tempo;
+        loopStart     = true;
+        loopEnd       = false;
+        songEnded     = false;
+        loopsPlayed   = 0;
+        stopped       = false;
+        fadeRequested = false;
+        waitingForNext = false;
+        CurrentPosition.wait = residual;
+        evh->ResetChannels();
+    }
+
+    /* True when the song has ended and no more events will be played */
+    bool Stopped() const { return stopped; }
+    /* True when the loop count is reached and the song should fade out */
+    bool FadeRequested() const { return fadeRequested; }
+
+    void SetPlaylist(PlaylistLoader *loader)
+    {
+        playlist = loader;
+    }
+
     /* Periodic tick handler.
      *   Input: s           = seconds since last call
      *   Input: granularity = don't expect intervals smaller than this, in seconds
@@ -248,9 +796,24 @@ public:
     double Tick(double s, double granularity)
     {
         if(CurrentPosition.began) CurrentPosition.wait -= s;
-        while(CurrentPosition.wait <= granularity * 0.5)
+        while(CurrentPosition.wait <= granularity * 0.5 && !stopped)
         {
             //std::fprintf(stderr, "wait = %g...\n", CurrentPosition.wait);
+            if(waitingForNext && !playlist->TakeNext(*this))
+            {
+                if(!playlist->Finished())
+                {
+                    // Hold the ended song and try again on the next tick,
+                    // while the released notes ring out
+                    CurrentPosition.wait = granularity;
+                    break;
+                }
+                // None of the remaining songs could be read
+                waitingForNext  = false;
+                CurrentPosition = LoopBeginPosition;
+                LoopOrStop();
+                continue;
+            }
             ProcessEvents();
         }
         return CurrentPosition.wait;
@@ -262,10 +825,37 @@ public:
         if(i != devices.end()) return i->second;
         size_t n = devices.size();
         devices.insert( std::make_pair(name, n) );
-        evh->SetNumPorts(n + 1);
+        if(!listener)
+            evh->SetNumPorts(n + 1);
         return n;
     }
 
+    /* Current tempo in quarter notes per minute */
+    double BeatsPerMinute() const
+    {
+        return 60e6 * InvDeltaTicks.value() / Tempo.value();
+    }
+
+    /* Walk through the song once without synthesis, feeding the
+     * channel events to the listener instead of the OPL.
+     */
+    void WalkSong(SongListener& song)
+    {
+        const Position saved_position = CurrentPosition;
+        const fraction<long> saved_tempo = Tempo;
+        listener  = &song;
+        walkTime  = 0;
+        songEnded = false;
+        listener->TempoChange(0, BeatsPerMinute());
+        while(!songEnded)
+            ProcessEvents();
+        listener = NULL;
+        CurrentPosition = saved_position;
+        Tempo     = saved_tempo;
+        loopStart = true;
+        current_device.clear();
+    }
+
 private:
 
     void ProcessEvents()
@@ -273,6 +863,7 @@ private:
         loopEnd = false;
         const size_t TrackCount = TrackData.size();
         const Position RowBeginPosition ( CurrentPosition );
+        const double RowTime = walkTime;
         for(size_t tk = 0; tk < TrackCount; ++tk)
         {
             if(CurrentPosition.track[tk].status >= 0
@@ -304,6 +895,7 @@ private:
 
         fraction<long> t = shortest * Tempo;
         if(CurrentPosition.began) CurrentPosition.wait += t.valuel();
+        if(listener && CurrentPosition.began && shortest > 0) walkTime += t.valuel();
 
         //if(shortest > 0) ui->PrintLn("Delay %ld (%g)", shortest, (double)t.valuel());
 
@@ -316,21 +908,54 @@ private:
         {
             LoopBeginPosition = RowBeginPosition;
             loopStart = false;
+            if(listener) listener->LoopStart(RowTime);
         }
         if(shortest < 0 || loopEnd)
         {
+            // Songs of a playlist only loop with -loops
+            if(playlist && !listener
+            && (LoopCount <= 0 || loopsPlayed >= (unsigned)LoopCount))
+            {
+                if(playlist->TakeNext(*this))
+                    return; // Go on with the next song, without a gap
+                if(!playlist->Finished())
+                {
+                    loopEnd        = false;
+                    waitingForNext = true; // See Tick
+                    return;
+                }
+            }
             // Loop if song end reached
             loopEnd         = false;
+            songEnded       = true;
             CurrentPosition = LoopBeginPosition;
             shortest        = 0;
-            if(QuitWithoutLooping)
+            if(listener)
             {
-                QuitFlag = true;
-                //^ HACK: QUIT WITHOUT LOOPING
+                listener->SongEnd(walkTime);
+                return;
             }
+            LoopOrStop();
         }
     }
 
+    /* Called at the end of the song, after going back to the loop start */
+    void LoopOrStop()
+    {
+        if(QuitWithoutLooping || (playlist && LoopCount < 0))
+            stopped = true;
+        else if(LoopCount >= 0 && ++loopsPlayed > (unsigned)LoopCount)
+        {
+            // Keep looping while fading out
+            if(FadeOutTime > 0)
+                fadeRequested = true;
+            else
+                stopped = true;
+        }
+        if(stopped) // Release any notes left hanging, let them ring out
+            evh->ResetChannels();
+    }
+
     void HandleEvent(size_t tk)
     {
         unsigned char byte = TrackData[tk][CurrentPosition.track[tk].ptr++];
@@ -347,11 +972,16 @@ private:
             std::string data( length?(const char*) &TrackData[tk][CurrentPosition.track[tk].ptr]:0, length );
             CurrentPosition.track[tk].ptr += length;
             if(evtype == 0x2F) { CurrentPosition.track[tk].status = -1; return; }
-            if(evtype == 0x51) { Tempo = InvDeltaTicks * fraction<long>( (long) ReadBEInt(data.data(), data.size())); return; }
+            if(evtype == 0x51)
+            {
+                Tempo = InvDeltaTicks * fraction<long>( (long) ReadBEInt(data.data(), data.size()));
+                if(listener) listener->TempoChange(walkTime, BeatsPerMinute());
+                return;
+            }
             if(evtype == 6 && data == "loopStart") loopStart = true;
             if(evtype == 6 && data == "loopEnd"  ) loopEnd   = true;
             if(evtype == 9) current_device[tk] = ChooseDevice(data);
-            if(evtype >= 1 && evtype <= 6)
+            if(evtype >= 1 && evtype <= 6 && !listener)
                 ui->PrintLn("Meta %d: %s", evtype, data.c_str());
             return;
         }
@@ -367,7 +997,10 @@ private:
             data[0] = byte;
             for(unsigned int x=1; x<length; ++x)
                 data[x] = TrackData[tk][CurrentPosition.track[tk].ptr++];
-            evh->HandleEvent(current_device[tk], data, length);
+            if(listener)
+                listener->HandleEvent(walkTime, current_device[tk], data, length);
+            else
+                evh->HandleEvent(current_device[tk], data, length);
         }
         if((byte&0xF0) == 0x90) // First note
             CurrentPosition.began  = true;
@@ -375,11 +1008,231 @@ private:
     }
 };
 
+PlaylistLoader::PlaylistLoader(const std::vector<std::string>& files, UIInterface *ui):
+    files(files),
+    next_file(0),
+    ready_file(0),
+    song(new MIDIplay(NULL, NULL)),
+    ui(ui),
+    state(Loading),
+    terminate(false),
+    thread(0)
+{
+}
+
+PlaylistLoader::~PlaylistLoader()
+{
+    if(thread)
+    {
+        terminate = true;
+        wakeup.Post();
+        SDL_WaitThread(thread, NULL);
+    }
+    delete song;
+}
+
+int PlaylistThread(void *loader)
+{
+    static_cast<PlaylistLoader*>(loader)->Run();
+    return 0;
+}
+
+void PlaylistLoader::Start()
+{
+    thread = SDL_CreateThread(PlaylistThread, this);
+}
+
+void PlaylistLoader::Run()
+{
+    while(!terminate)
+    {
+        if(state == Loading)
+        {
+            bool ok = false;
+            while(!ok && next_file < files.size() && !terminate)
+            {
+                ready_file = next_file++;
+                ok = song->ParseMIDI(files[ready_file]);
+            }
+            state = ok ? Ready : Done;
+            if(!ok)
+                break;
+        }
+        wakeup.Wait();
+    }
+}
+
+bool PlaylistLoader::TakeNext(MIDIplay& player)
+{
+    if(state != Ready)
+        return false;
+    player.ContinueWith(*song);
+    ui->PrintLn("Playing %s", files[ready_file].c_str());
+    state = Loading;
+    wakeup.Post();
+    return true;
+}
+
+/* Read a playlist file, with one file name per line */
+static bool ReadPlaylist(const char *filename, std::vector<std::string>& files)
+{
+    std::FILE* fp = std::fopen(filename, "r");
+    if(!fp) { std::perror(filename); return false; }
+    char line[4096];
+    while(std::fgets(line, sizeof(line), fp))
+    {
+        line[std::strcspn(line, "\r\n")] = 0;
+        if(line[0] && line[0] != '#')
+            files.push_back(line);
+    }
+    std::fclose(fp);
+    return true;
+}
+
+/* Add all files below a directory, in sorted order */
+static void ReadDirectory(const std::string& path, std::vector<std::string>& files)
+{
+    DIR *dir = opendir(path.c_str());
+    if(!dir) { std::perror(path.c_str()); return; }
+    std::vector<std::string> names;
+    while(struct dirent *ent = readdir(dir))
+        if(ent->d_name[0] != '.')
+            names.push_back(ent->d_name);
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for(size_t a=0; a<names.size(); ++a)
+    {
+        std::string name = path + "/" + names[a];
+        struct stat st;
+        if(stat(name.c_str(), &st) != 0) continue;
+        if(S_ISDIR(st.st_mode))
+            ReadDirectory(name, files);
+        else if(S_ISREG(st.st_mode))
+            files.push_back(name);
+    }
+}
+
+/** Scan a list of songs on all processors */
+class SongCatalogue
+{
+public:
+    std::vector<std::string> files;
+    std::vector<SongScanner> songs;
+    std::vector<char> valid; // Not vector<bool>, threads write neighbouring entries
+
+    void Scan()
+    {
+        songs.assign(files.size(), SongScanner());
+        valid.assign(files.size(), false);
+        next = 0;
+        long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if(n_threads < 1) n_threads = 1;
+        std::vector<SDL_Thread*> threads;
+        for(long a=1; a<n_threads && (size_t)a<files.size(); ++a)
+            threads.push_back(SDL_CreateThread(ScanThread, this));
+        Run();
+        for(size_t a=0; a<threads.size(); ++a)
+            SDL_WaitThread(threads[a], NULL);
+    }
+    void WriteJSON(std::FILE *fp) const;
+    void WriteCSV(std::FILE *fp) const;
+private:
+    std::atomic<size_t> next;
+
+    void Run()
+    {
+        MIDIplay player(NULL, NULL);
+        for(size_t a; (a = next++) < files.size(); )
+            valid[a] = player.ScanMIDI(files[a], songs[a]);
+    }
+    static int ScanThread(void *catalogue)
+    {
+        static_cast<SongCatalogue*>(catalogue)->Run();
+        return 0;
+    }
+};
+
+static void WriteQuoted(std::FILE *fp, const std::string& s, bool json)
+{
+    std::fputc('"', fp);
+    for(size_t a=0; a<s.size(); ++a)
+    {
+        unsigned char c = s[a];
+        if(!json && c == '"')
+            std::fputs("\"\"", fp);
+        else if(!json)
+            std::fputc(c, fp);
+        else if(c == '"' || c == '\\')
+            std::fprintf(fp, "\\%c", c);
+        else if(c < 0x20)
+            std::fprintf(fp, "\\u%04x", c);
+        else
+            std::fputc(c, fp);
+    }
+    std::fputc('"', fp);
+}
+
+static void WriteList(std::FILE *fp, const std::set<unsigned>& list, const char *sep)
+{
+    for(std::set<unsigned>::const_iterator i = list.begin(); i != list.end(); ++i)
+        std::fprintf(fp, "%s%u", i == list.begin() ? "" : sep, *i);
+}
+
+void SongCatalogue::WriteJSON(std::FILE *fp) const
+{
+    const unsigned loops = LoopCount >= 0 ? LoopCount : 1;
+    std::fprintf(fp, "[");
+    bool first = true;
+    for(size_t a=0; a<files.size(); ++a)
+    {
+        if(!valid[a]) continue;
+        const SongScanner& s = songs[a];
+        std::fprintf(fp, "%s\n  {\"file\": ", first ? "" : ",");
+        first = false;
+        WriteQuoted(fp, files[a], true);
+        std::fprintf(fp, ", \"length\": %.3f, \"loop_start\": %.3f, \"looped_length\": %.3f",
+            s.length, s.loop_start, s.LoopedLength(loops));
+        std::fprintf(fp, ",\n   \"tempos\": [");
+        for(size_t t=0; t<s.tempos.size(); ++t)
+            std::fprintf(fp, "%s[%.3f, %.3f]", t ? ", " : "", s.tempos[t].first, s.tempos[t].second);
+        std::fprintf(fp, "],\n   \"programs\": [");
+        WriteList(fp, s.programs, ", ");
+        std::fprintf(fp, "], \"percussion\": [");
+        WriteList(fp, s.percussion, ", ");
+        std::fprintf(fp, "]}");
+    }
+    std::fprintf(fp, "\n]\n");
+}
+
+void SongCatalogue::WriteCSV(std::FILE *fp) const
+{
+    const unsigned loops = LoopCount >= 0 ? LoopCount : 1;
+    std::fprintf(fp, "file,length,loop_start,looped_length,tempos,programs,percussion\n");
+    for(size_t a=0; a<files.size(); ++a)
+    {
+        if(!valid[a]) continue;
+        const SongScanner& s = songs[a];
+        WriteQuoted(fp, files[a], false);
+        std::fprintf(fp, ",%.3f,%.3f,%.3f,", s.length, s.loop_start, s.LoopedLength(loops));
+        for(size_t t=0; t<s.tempos.size(); ++t)
+            std::fprintf(fp, "%s%.3f:%.3f", t ? " " : "", s.tempos[t].first, s.tempos[t].second);
+        std::fprintf(fp, ",");
+        WriteList(fp, s.programs, " ");
+        std::fprintf(fp, ",");
+        WriteList(fp, s.percussion, " ");
+        std::fprintf(fp, "\n");
+    }
+}
+
 static void TidyupAndExit(int signal)
 {
     QuitFlag = true;
     ExitSignal = signal;
 }
+static void RequestReport(int)
+{
+    ReportFlag = true;
+}
 
 /** Synthesize samples from midi file.
  */
@@ -388,10 +1241,18 @@ class SynthLoop: public AudioGenerator
 private:
     MIDIeventhandler evh;
     unsigned sample_rate;
+public:
+    unsigned long fade_length, fade_left;
+    unsigned long remaining; // Samples until MaxDuration is reached
+    bool fading;
 public:
     SynthLoop(unsigned int sample_rate, UIInterface *ui):
         evh(sample_rate, ui),
         sample_rate(sample_rate),
+        fade_length(FadeOutTime * sample_rate),
+        fade_left(0),
+        remaining(MaxDuration > 0 ? (unsigned long)(MaxDuration * sample_rate) : ULONG_MAX),
+        fading(false),
         player(&evh, ui),
         delay(0)
     {
@@ -399,24 +1260,70 @@ public:
     ~SynthLoop() {}
 
     void RequestSamples(unsigned long count, float* samples_out)
+    {
+        Render(count, samples_out, samples_out+1, 2);
+    }
+    void RequestSamplesPlanar(unsigned long count, float* left, float* right)
+    {
+        Render(count, left, right, 1);
+    }
+    bool Finished() const
+    {
+        return QuitFlag;
+    }
+    MIDIplay player;
+    /** Delay until next event */
+    unsigned long delay;
+private:
+    void Render(unsigned long count, float* left, float* right, int step)
     {
         unsigned long offset = 0;
-        // Update adds in samples, so initialize to zero
-        memset(samples_out, 0, count*2*sizeof(float));
+        // Render adds in samples, so initialize to zero
+        for(unsigned long a = 0; a < count; ++a)
+            left[a*step] = right[a*step] = 0.0f;
         while(offset < count && !QuitFlag)
         {
-            unsigned long n_samples = std::min(count - offset, std::min(delay, (unsigned long)MaxSamplesAtTime));
+            if(!fading && (player.FadeRequested() || remaining <= fade_length))
+            {
+                fading    = true;
+                fade_left = std::min(fade_length, remaining);
+            }
+            // Stop when the song has rung out, the fade is done or time is up
+            if((player.Stopped() && evh.IsSilent())
+            || (fading && fade_left == 0) || remaining == 0)
+            {
+                QuitFlag = true;
+                break;
+            }
+            unsigned long n_samples = std::min(count - offset, (unsigned long)MaxSamplesAtTime);
+            if(!player.Stopped())
+                n_samples = std::min(n_samples, delay);
+            if(fading)
+                n_samples = std::min(n_samples, fade_left);
+            else if(remaining != ULONG_MAX)
+                n_samples = std::min(n_samples, remaining - fade_length);
 
-            evh.Update(&samples_out[offset*2], n_samples);
+            float *l = left + offset*step, *r = right + offset*step;
+            evh.Render(l, r, step, n_samples);
+            if(fading)
+            {
+                for(unsigned long a = 0; a < n_samples; ++a)
+                {
+                    float gain = (fade_left - a) / (float)fade_length;
+                    l[a*step] *= gain;
+                    r[a*step] *= gain;
+                }
+                fade_left -= n_samples;
+            }
+            if(remaining != ULONG_MAX)
+                remaining -= n_samples;
             offset += n_samples;
-            delay = ceil(player.Tick(
-                        n_samples / (double)sample_rate,
-                        1.0 / (double)sample_rate) * (double)sample_rate);
+            if(!player.Stopped())
+                delay = ceil(player.Tick(
+                            n_samples / (double)sample_rate,
+                            1.0 / (double)sample_rate) * (double)sample_rate);
         }
     }
-    MIDIplay player;
-    /** Delay until next event */
-    unsigned long delay;
 };
 
 int main(int argc, char** argv)
@@ -431,29 +1338,103 @@ int main(int argc, char** argv)
 
     signal(SIGTERM, TidyupAndExit);
     signal(SIGINT, TidyupAndExit);
+    signal(SIGUSR1, RequestReport);
 
     int rv = ParseArguments(argc, argv);
     if(rv >= 0)
         return rv;
 
+    std::vector<std::string> files;
+    struct stat st;
+    if(PlaylistMode)
+    {
+        if(!ReadPlaylist(argv[1], files))
+            return 2;
+    }
+    else if(ScanFormat != SCAN_NONE && stat(argv[1], &st) == 0 && S_ISDIR(st.st_mode))
+        ReadDirectory(argv[1], files);
+    else
+        files.push_back(argv[1]);
+
+    if(ScanFormat != SCAN_NONE)
+    {
+        SongCatalogue catalogue;
+        catalogue.files = files;
+        catalogue.Scan();
+        if(ScanFormat == SCAN_JSON)
+            catalogue.WriteJSON(stdout);
+        else
+            catalogue.WriteCSV(stdout);
+        return 0;
+    }
+
     unsigned int sample_rate = 0;
     InitializeAudio(AudioBufferLength, &sample_rate);
 
-    UI *ui = new UI();
+    UIInterface *ui;
+#ifdef USE_QT
+    if(QtFrontend)
+        ui = CreateQtUI();
+    else
+#endif
+        ui = new UI();
     SynthLoop audio_gen(sample_rate, ui);
-    if(!audio_gen.player.LoadMIDI(argv[1]))
+    size_t first = 0;
+    while(first < files.size() && !audio_gen.player.LoadMIDI(files[first]))
+        ++first;
+    if(first == files.size())
         return 2;
-    StartAudio(&audio_gen, NULL, ui);
+    PlaylistLoader *playlist = 0;
+    if(PlaylistMode) // Even without songs left, so that the last one ends
+    {
+        playlist = new PlaylistLoader(
+            std::vector<std::string>(files.begin() + first + 1, files.end()), ui);
+        audio_gen.player.SetPlaylist(playlist);
+        playlist->Start();
+    }
+    StartAudio(&audio_gen, NULL, ui, RenderAheadTime);
 
     /// XXX need condition for when to quit
+    unsigned reported_underruns = 0;
+    char summary[256];
     while(!QuitFlag)
-        sleep(1);
+    {
+#ifdef USE_QT
+        if(QtFrontend)
+        {
+            if(!RunQtUI(1000))
+                break; // Window closed
+        }
+        else
+#endif
+            sleep(1);
+        if(ReportFlag)
+        {
+            ReportFlag = false;
+            AudioCallbackSummary(summary, sizeof(summary));
+            ui->PrintLn("%s", summary);
+        }
+        double fill;
+        unsigned underruns;
+        if(RenderAheadStatus(&fill, &underruns) && underruns != reported_underruns)
+        {
+            ui->PrintLn("Audio buffer %.0f%% full, %u underruns", fill * 100.0, underruns);
+            reported_underruns = underruns;
+        }
+    }
+    // The song ended, let the audio rendered ahead play out
+    if(!ExitSignal)
+        DrainAudio();
 
     ShutdownAudio();
+    delete playlist; playlist = 0;
     delete ui; ui = 0;
+    AudioCallbackSummary(summary, sizeof(summary));
+    InitMessage(-1, "%s\n", summary);
 
     signal(SIGTERM, SIG_DFL);
     signal(SIGINT, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
     if(ExitSignal)
         raise(ExitSignal);
 
@@ -43,6 +43,7 @@
  * 
  */
 
+#include <algorithm>
 #include <math.h>
 #include <limits>
 #include <string.h>
@@ -559,6 +560,8 @@ public:
 	int vibratoIndex, tremoloIndex;
 
 	bool FullPan;
+	// No channel generated output for the last sample
+	bool silent;
 	
 	static OperatorDataStruct *OperatorData;
 	static OPL3DataStruct *OPL3Data;
@@ -589,6 +592,7 @@ private:
 	void update_2_CONNECTIONSEL6();
 	void set4opConnections();
 	void setRhythmMode();
+	void Generate(float *left, float *right, int step, int length, float *channelOutputs);
 
 	static int InstanceCount;
 
@@ -596,16 +600,30 @@ private:
 public:
 	void Reset();
 	void WriteReg(int reg, int v);
-	void Update(float *buffer, int length);
+	void Render(float *left, float *right, int step, int length);
+	bool RenderChannels(float *left, float *right, int step, int length, float *channels);
 	void SetPanning(int c, float left, float right);
+	bool IsSilent() const;
 };
 
 OperatorDataStruct *OPL3::OperatorData;
 OPL3DataStruct *OPL3::OPL3Data;
 int OPL3::InstanceCount;
 
-void OPL3::Update(float *output, int numsamples) {
-	while (numsamples--) {
+void OPL3::Render(float *left, float *right, int step, int numsamples) {
+	Generate(left, right, step, numsamples, NULL);
+}
+
+bool OPL3::RenderChannels(float *left, float *right, int step, int numsamples, float *channels) {
+	// Channels that are disabled or not generated stay silent
+	std::fill(channels, channels + NumChannels * numsamples, 0.0f);
+	Generate(left, right, step, numsamples, channels);
+	return true;
+}
+
+void OPL3::Generate(float *left, float *right, int step, int numsamples, float *channelOutputs) {
+	for (int i = 0; i < numsamples; i++) {
+		silent = true;
 		// If _new = 0, use OPL2 mode with 9 channels. If _new = 1, use OPL3 18 channels;
 		for(int array=0; array < (_new + 1); array++)
 			for(int channelNumber=0; channelNumber < 9; channelNumber++) {
@@ -614,8 +632,10 @@ void OPL3::Update(float *output, int numsamples) {
 				if (channel != &disabledChannel)
 				{
 					double channelOutput = channel->getChannelOutput(this);
-					output[0] += float(channelOutput * channel->leftPan);
-					output[1] += float(channelOutput * channel->rightPan);
+					if (channelOutputs)
+						channelOutputs[(array * 9 + channelNumber) * numsamples + i] = float(channelOutput * VOLUME_MUL);
+					*left += float(channelOutput * channel->leftPan);
+					*right += float(channelOutput * channel->rightPan);
 				}
 			}
 
@@ -626,7 +646,8 @@ void OPL3::Update(float *output, int numsamples) {
 		// EnvelopeGenerator.getEnvelope() in each Operator.
 		tremoloIndex++;
 		if(tremoloIndex >= OPL3Data->tremoloTableLength) tremoloIndex = 0;
-		output += 2;
+		left += step;
+		right += step;
 	}
 }
 
@@ -721,6 +742,7 @@ OPL3::OPL3(unsigned sample_rate, bool fullpan)
   highHatSnareDrumChannel(fullpan ? CENTER_PANNING_POWER : 1, &highHatOperator, &snareDrumOperator)
 {
 	FullPan = fullpan;
+	silent = true;
     nts = dam = dvb = ryt = bd = sd = tom = tc = hh = _new = connectionsel = 0;
     vibratoIndex = tremoloIndex = 0; 
 
@@ -1076,6 +1098,7 @@ double Channel2op::getChannelOutput(OPL3 *OPL3) {
 			channelOutput = (op1Output + op2Output) / 2;
 	}
 	
+	OPL3->silent = false;
 	feedback[0] = feedback[1];
 	feedback[1] = StripIntPart(op1Output * ChannelData::feedback[fb]);
 	return channelOutput;
@@ -1172,6 +1195,8 @@ double Channel4op::getChannelOutput(OPL3 *OPL3) {
 			channelOutput = (op1Output + op3Output + op4Output) / 3;
 	}
 	
+	OPL3->silent = false;
+	
 	feedback[0] = feedback[1];
 	feedback[1] = StripIntPart(op1Output * ChannelData::feedback[fb]);
 
@@ -1592,6 +1617,9 @@ double RhythmChannel::getChannelOutput(OPL3 *OPL3) {
 	op2Output = op2->getOperatorOutput(OPL3, Operator::noModulator);        
 	channelOutput = (op1Output + op2Output) / 2;
 	
+	if(op1->envelopeGenerator.stage!=EnvelopeGenerator::OFF ||
+		op2->envelopeGenerator.stage!=EnvelopeGenerator::OFF)
+		OPL3->silent = false;
 	return channelOutput;
 };
 
@@ -1870,6 +1898,11 @@ void OPL3::SetPanning(int c, float left, float right)
 	}
 }
 
+bool OPL3::IsSilent() const
+{
+	return silent;
+}
+
 OPLEmul *JavaOPLCreate(unsigned int sample_rate, bool stereo)
 {
         if(sample_rate > OPL_MAX_SAMPLE_RATE)
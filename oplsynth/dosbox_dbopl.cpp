@@ -792,7 +792,7 @@ void Channel::ResetC0( const Chip* chip ) {
 };
 
 template< bool opl3Mode>
-INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
+INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output, Bit32s* chanOutput ) {
 	Channel* chan = this;
 
 	//BassDrum
@@ -807,6 +807,7 @@ INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
 		mod = old[0];
 	}
 	Bit32s sample = Op(1)->GetSample( mod ); 
+	Bit32s bassDrum = sample;
 
 
 	//Precalculate stuff used by other outputs
@@ -827,6 +828,8 @@ INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
 		Bit32u sdIndex = ( 0x100 + (c2 & 0x100) ) ^ ( noiseBit << 8 );
 		sample += Op(3)->GetWave( sdIndex, sdVol );
 	}
+	//Channel 7 plays the hi-hat and snare drum, channel 8 the rest
+	Bit32s hiHatSnare = sample - bassDrum;
 	//Tom-tom
 	sample += Op(4)->GetSample( 0 );
 
@@ -836,6 +839,12 @@ INLINE void Channel::GeneratePercussion( Chip* chip, Bit32s* output ) {
 		Bit32u tcIndex = (1 + phaseBit) << 8;
 		sample += Op(5)->GetWave( tcIndex, tcVol );
 	}
+	if ( chanOutput ) {
+		Bitu stride = chip->channelStride;
+		chanOutput[0] += bassDrum << 1;
+		chanOutput[stride] += hiHatSnare << 1;
+		chanOutput[stride * 2] += ( sample - bassDrum - hiHatSnare ) << 1;
+	}
 	sample <<= 1;
 	if ( opl3Mode ) {
 		output[0] += sample;
@@ -898,13 +907,18 @@ Channel* Channel::BlockTemplate( Chip* chip, Bit32u samples, Bit32s* output ) {
 		Op( 4 )->Prepare( chip );
 		Op( 5 )->Prepare( chip );
 	}
+	Bit32s* chanOutput = chip->channelOutput ? chip->channelOutput + ( this - chip->chan ) * chip->channelStride : 0;
+	//Percussion channels are never skipped, check their envelopes
+	if ( mode < sm6Start || !Op(0)->Silent() || !Op(1)->Silent() || !Op(2)->Silent()
+		|| !Op(3)->Silent() || !Op(4)->Silent() || !Op(5)->Silent() )
+		chip->silent = false;
 	for ( Bitu i = 0; i < samples; i++ ) {
 		//Early out for percussion handlers
 		if ( mode == sm2Percussion ) {
-			GeneratePercussion<false>( chip, output + i );
+			GeneratePercussion<false>( chip, output + i, chanOutput ? chanOutput + i : 0 );
 			continue;	//Prevent some unitialized value bitching
 		} else if ( mode == sm3Percussion ) {
-			GeneratePercussion<true>( chip, output + i * 2 );
+			GeneratePercussion<true>( chip, output + i * 2, chanOutput ? chanOutput + i : 0 );
 			continue;	//Prevent some unitialized value bitching
 		}
 
@@ -937,6 +951,8 @@ Channel* Channel::BlockTemplate( Chip* chip, Bit32u samples, Bit32s* output ) {
 			sample += Op(2)->GetSample( next );
 			sample += Op(3)->GetSample( 0 );
 		}
+		if ( chanOutput )
+			chanOutput[ i ] += sample;
 		switch( mode ) {
 		case sm2AM:
 		case sm2FM:
@@ -981,6 +997,9 @@ Chip::Chip() {
 	regBD = 0;
 	reg104 = 0;
 	opl3Active = 0;
+	silent = true;
+	channelOutput = 0;
+	channelStride = 0;
 }
 
 INLINE Bit32u Chip::ForwardNoise() {
@@ -1181,6 +1200,7 @@ void Chip::GenerateBlock2( Bitu total, Bit32s* output ) {
 		Bit32u samples = ForwardLFO( total );
 		memset(output, 0, sizeof(Bit32s) * samples);
 		int count = 0;
+		silent = true;
 		for( Channel* ch = chan; ch < chan + 9; ) {
 			count++;
 			ch = (ch->*(ch->synthHandler))( this, samples, output );
@@ -1194,13 +1214,20 @@ void Chip::GenerateBlock3( Bitu total, Bit32s* output  ) {
 	while ( total > 0 ) {
 		Bit32u samples = ForwardLFO( total );
 		memset(output, 0, sizeof(Bit32s) * samples *2);
+		if ( channelOutput ) {
+			for ( Bitu c = 0; c < 18; c++ )
+				memset(channelOutput + c * channelStride, 0, sizeof(Bit32s) * samples);
+		}
 		int count = 0;
+		silent = true;
 		for( Channel* ch = chan; ch < chan + 18; ) {
 			count++;
 			ch = (ch->*(ch->synthHandler))( this, samples, output );
 		}
 		total -= samples;
 		output += samples * 2;
+		if ( channelOutput )
+			channelOutput += samples;
 	}
 }
 
@@ -1576,12 +1603,14 @@ private:
 	Chip chip;
 	bool fullpan;
         unsigned int sample_rate;
+	// Output of each channel for RenderChannels, 512 samples apart
+	Bit32s channelBuffer[ 512 * 18 ];
 public:
 	void Reset()
 	{
 		chip.Setup(sample_rate);
 	}
-	void Update(float* sndptr, int numsamples)
+	void Render(float* left, float* right, int step, int numsamples)
 	{
 		Bit32s buffer[ 512 * 2 ];
 		if ( GCC_UNLIKELY(numsamples > 512) )
@@ -1589,9 +1618,31 @@ public:
 		// Force OPL3/stereo samples
 		chip.GenerateBlock3( numsamples, buffer );
 		// Convert to floating point
-		const int stereosamples = numsamples*2;
-		for(int idx=0; idx<stereosamples; ++idx)
-			sndptr[idx] += buffer[idx] / 10240.0;
+		for(int idx=0; idx<numsamples; ++idx)
+		{
+			left[idx*step] += buffer[idx*2+0] / 10240.0;
+			right[idx*step] += buffer[idx*2+1] / 10240.0;
+		}
+	}
+	bool RenderChannels(float* left, float* right, int step, int numsamples, float* channels)
+	{
+		if ( GCC_UNLIKELY(numsamples > 512) )
+			numsamples = 512;
+		chip.channelOutput = channelBuffer;
+		chip.channelStride = 512;
+		Render(left, right, step, numsamples);
+		chip.channelOutput = 0;
+		for(int c=0; c<18; ++c)
+		{
+			// The chip keeps the channels that can pair up for four-op next to eachother
+			int index = c % 9;
+			if ( index < 6 )
+				index = (index % 3) * 2 + ( index / 3 );
+			const Bit32s* in = channelBuffer + ( c / 9 * 9 + index ) * 512;
+			for(int idx=0; idx<numsamples; ++idx)
+				channels[c*numsamples + idx] = in[idx] / 10240.0;
+		}
+		return true;
 	}
 	void WriteReg(int idx, int val)
 	{
@@ -1601,6 +1652,10 @@ public:
 	{
 		// TODO
 	}
+	bool IsSilent() const
+	{
+		return chip.silent;
+	}
 	DBOPLv2(unsigned int sample_rate, bool fullpan):
             fullpan(fullpan),
             sample_rate(sample_rate)
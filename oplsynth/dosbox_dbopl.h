@@ -195,7 +195,7 @@ struct Channel {
 
 	//call this for the first channel
 	template< bool opl3Mode >
-	void GeneratePercussion( Chip* chip, Bit32s* output );
+	void GeneratePercussion( Chip* chip, Bit32s* output, Bit32s* chanOutput );
 
 	//Generate blocks of data in specific modes
 	template<SynthMode mode>
@@ -238,6 +238,12 @@ struct Chip {
 	Bit8u waveFormMask;
 	//0 or -1 when enabled
 	Bit8s opl3Active;
+	//No channel generated output in the last block
+	bool silent;
+	//When set, every channel also adds its output to its own buffer,
+	//channel c at channelOutput[c * channelStride]
+	Bit32s* channelOutput;
+	Bitu channelStride;
 
 	//Return the maximum amount of samples before and LFO change
 	Bit32u ForwardLFO( Bit32u samples );
@@ -466,6 +466,13 @@ void DBOPL::disable_operator(op_type* op_pt, Bit32u act_type) {
 	}
 }
 
+bool DBOPL::IsSilent() const {
+	for (Bits i=0;i<MAXOPERATORS;i++) {
+		if (op[i].op_state != OF_TYPE_OFF) return false;
+	}
+	return true;
+}
+
 void DBOPL::Reset() {
 	Bits i, j, oct;
 
@@ -907,7 +914,7 @@ static void OPL_INLINE clipit16(float ival, float* outval) {
 	outbufl[i] += chanval;
 #endif
 
-void DBOPL::Update(float* sndptr, int numsamples) {
+void DBOPL::Render(float* left, float* right, int step, int numsamples) {
 	Bits i, endsamples;
 	op_type* cptr;
 
@@ -1399,20 +1406,22 @@ void DBOPL::Update(float* sndptr, int numsamples) {
 		if (adlibreg[0x105]&1) {
 			// convert to float samples (stereo->stereo)
 			for (i=0;i<endsamples;i++) {
-				clipit16(outbufl[i],sndptr++);
-				clipit16(outbufr[i],sndptr++);
+				clipit16(outbufl[i],left); left += step;
+				clipit16(outbufr[i],right); right += step;
 			}
 		} else {
 			// convert to float samples (mono->stereo)
 			for (i=0;i<endsamples;i++) {
-				clipit16(outbufl[i],sndptr++);
-				clipit16(outbufl[i],sndptr++);
+				clipit16(outbufl[i],left); left += step;
+				clipit16(outbufl[i],right); right += step;
 			}
 		}
 #else
-		// convert to float samples
-		for (i=0;i<endsamples;i++)
-			clipit16(outbufl[i],sndptr++);
+		// convert to float samples (mono->stereo)
+		for (i=0;i<endsamples;i++) {
+			clipit16(outbufl[i],left); left += step;
+			clipit16(outbufl[i],right); right += step;
+		}
 #endif
 
 	}
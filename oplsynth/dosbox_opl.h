@@ -221,9 +221,10 @@ private:
 	// general functions
 public:
 	void Reset();
-	void Update(float* sndptr, int numsamples);
+	void Render(float* left, float* right, int step, int numsamples);
 	void WriteReg(int idx, int val);
 	void SetPanning(int c, float left, float right);
+	bool IsSilent() const;
 
 	DBOPL(Bit32u samplerate, bool stereo);
 };
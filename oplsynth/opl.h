@@ -11,8 +11,22 @@ public:
 
 	virtual void Reset() = 0;
 	virtual void WriteReg(int reg, int v) = 0;
-	virtual void Update(float *buffer, int length) = 0;
+	// Add length stereo samples to left and right, each step floats apart
+	virtual void Render(float *left, float *right, int step, int length) = 0;
+	// Add length samples to an interleaved stereo buffer
+	void Update(float *buffer, int length) { Render(buffer, buffer+1, 2, length); }
+	// Add length samples to separate left and right buffers
+	void UpdatePlanar(float *left, float *right, int length) { Render(left, right, 1, length); }
+	// Render, and also write (not add) the output of each of the
+	// NumChannels channels on its own, mono and before panning, to
+	// channels[c*length + i]. Four-op channels come out of their first
+	// channel, the rhythm section out of channels 6, 7 and 8. Returns
+	// false, without rendering anything, if the emulator cannot do this.
+	virtual bool RenderChannels(float * /*left*/, float * /*right*/, int /*step*/, int /*length*/, float * /*channels*/) { return false; }
+	enum { NumChannels = 18 };
 	virtual void SetPanning(int c, float left, float right) = 0;
+	// True if every operator envelope has decayed to silence
+	virtual bool IsSilent() const = 0;
 };
 
 OPLEmul *DBOPLCreate(unsigned int sample_rate, bool stereo);
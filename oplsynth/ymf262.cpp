@@ -2831,14 +2831,24 @@ public:
 		//Chip.P_CH[c].RightVol = right;
 	}
 
+	bool IsSilent() const
+	{
+		for(int c=0; c<18; ++c)
+			if(Chip.P_CH[c].SLOT[SLOT1].state != EG_OFF
+			|| Chip.P_CH[c].SLOT[SLOT2].state != EG_OFF)
+				return false;
+		return true;
+	}
+
 
 	/*
 	** Generate samples for one of the YM3812's
 	**
-	** '*buffer' is the output buffer pointer
+	** '*left' and '*right' are the output buffer pointers
+	** 'step' is the distance between consecutive samples in them
 	** 'length' is the number of samples that should be generated
 	*/
-	void Update(float *buffer, int length)
+	void Render(float *left, float *right, int step, int length)
 	{
 		if(length > 512)
 			length = 512;
@@ -2849,8 +2859,8 @@ public:
 		ymf262_update_one(&Chip, buffers, length);
 		for(int idx=0; idx<length; ++idx)
 		{
-			buffer[idx*2+0] += a[idx] / 10240.0;
-			buffer[idx*2+1] += b[idx] / 10240.0;
+			left[idx*step] += a[idx] / 10240.0;
+			right[idx*step] += b[idx] / 10240.0;
 		}
 	}
 };
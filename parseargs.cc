@@ -18,12 +18,32 @@ bool HighTremoloMode   = false;
 bool HighVibratoMode   = false;
 bool AdlPercussionMode = false;
 bool QuitWithoutLooping = false;
-bool WritePCMfile = false;
 bool ScaleModulators = false;
 OPLEmuType EmuType = OPLEMU_DBOPLv2;
 bool FullPan = true;
 bool AllowBankSwitch = false;
 bool EnableReverb = true;
+bool SoftClipping = false;
+double OutputGain = 0.0;
+double LimiterLookahead = 0.0;
+unsigned XMISequence = 0;
+bool AnalyzeSong = false;
+bool PlaylistMode = false;
+int LoopCount = -1;
+double FadeOutTime = 0.0;
+double MaxDuration = 0.0;
+ScanFormatType ScanFormat = SCAN_NONE;
+bool DirectMIDIInput = false;
+double RenderAheadTime = 0.0;
+unsigned NumMIDIPorts = 1;
+bool CardOutputs = false;
+bool MasterMix = true;
+AudioOutputType AudioOutput = AUDIOOUT_DEVICE;
+const char *WAVFileName = "adlmidi.wav";
+double AudioPeriod = 0.0;
+bool FreeRunAudio = false;
+bool QtFrontend = false;
+bool ChannelMeters = false;
 
 int ParseArguments(int argc, char **argv)
 {
@@ -37,11 +57,33 @@ int ParseArguments(int argc, char **argv)
             " -v Enables vibrato amplification mode\n"
             " -s Enables scaling of modulator volumes\n"
             " -nl Quit without looping\n"
-            " -w Write WAV file rather than playing\n"
+            " -loops=<n> Quit after looping n times\n"
+            " -fade=<s> Fade out over s seconds after the last loop\n"
+            " -maxlen=<s> Quit after s seconds, fading out at the end with -fade\n"
+            " -scan=json|csv Print length, loops, tempos and instruments of the song,\n"
+            "    all files in the directory, or the playlist with -pl, without playing\n"
+            " -direct Read ALSA MIDI input from the audio thread (adlseq)\n"
+            " -ahead=<ms> Synthesize ms milliseconds ahead in a separate thread (adlmidi)\n"
+            " -ports=<n> Number of JACK MIDI inputs, each with its own 16 channels (adlseq, adljack)\n"
+            " -stems Add a stereo JACK output for every OPL card (adljack)\n"
+            " -nomix Leave out the stereo master mix when using -stems (adljack)\n"
+            " -w[=<file>] Write WAV file (adlmidi.wav) rather than playing\n"
+            " -null Run the audio pipeline without any output, for benchmarking\n"
+            " -period=<ms> Audio period with -w and -null, default is the device buffer length\n"
+            " -freerun Render as fast as possible with -w and -null, instead of in real time\n"
+            " -qt Show the channels in a window instead of on the terminal (adlmidi, if built with Qt)\n"
+            " -meters Show the measured output level of every OPL channel (dboplv2, vintage)\n"
             " -emu=<emu> Set OPL emulator to use (dbopl, dboplv2, vintage, ym3812, ymf262)\n"
             " -fp Enable full stereo panning\n"
             " -bs Allow bank switch (Bank LSB changes bank)\n"
             " -noreverb Disable reverb\n"
+            " -softclip Saturate smoothly near full scale instead of clipping hard\n"
+            " -gain=<dB> Amplify the output by dB decibels\n"
+            " -limit[=<ms>] Limit the output peaks, looking ms (5) milliseconds ahead\n"
+            " -seq=<n> Select sequence to play from multi-sequence XMI files\n"
+            " -a Analyze the song and use the fewest cards and four-op channels it needs (not with -pl)\n"
+            " -pl <midifilename> is a playlist with one file name per line, played without gaps;\n"
+            "    the songs only loop with -loops\n"
         );
         for(unsigned a=0; a<sizeof(banknames)/sizeof(*banknames); ++a)
             InitMessage(-1, "%10s%2u = %s\n",
@@ -73,7 +115,22 @@ int ParseArguments(int argc, char **argv)
         else if(!std::strcmp("-nl", argv[2]))
             QuitWithoutLooping = true;
         else if(!std::strcmp("-w", argv[2]))
-            WritePCMfile = true;
+            AudioOutput = AUDIOOUT_FILE;
+        else if(!std::strncmp("-w=", argv[2], 3))
+        {
+            AudioOutput = AUDIOOUT_FILE;
+            WAVFileName = argv[2]+3;
+        }
+        else if(!std::strcmp("-null", argv[2]))
+            AudioOutput = AUDIOOUT_NULL;
+        else if(!std::strncmp("-period=", argv[2], 8))
+            AudioPeriod = std::atof(argv[2]+8) / 1000.0;
+        else if(!std::strcmp("-freerun", argv[2]))
+            FreeRunAudio = true;
+        else if(!std::strcmp("-qt", argv[2]))
+            QtFrontend = true;
+        else if(!std::strcmp("-meters", argv[2]))
+            ChannelMeters = true;
         else if(!std::strcmp("-s", argv[2]))
             ScaleModulators = true;
         else if(!std::strcmp("-fp", argv[2]))
@@ -99,12 +156,60 @@ int ParseArguments(int argc, char **argv)
             AllowBankSwitch = true;
         else if(!std::strcmp("-noreverb", argv[2]))
             EnableReverb = false;
+        else if(!std::strcmp("-softclip", argv[2]))
+            SoftClipping = true;
+        else if(!std::strncmp("-gain=", argv[2], 6))
+            OutputGain = std::atof(argv[2]+6);
+        else if(!std::strcmp("-limit", argv[2]))
+            LimiterLookahead = 0.005;
+        else if(!std::strncmp("-limit=", argv[2], 7))
+            LimiterLookahead = std::atof(argv[2]+7) / 1000.0;
+        else if(!std::strcmp("-a", argv[2]))
+            AnalyzeSong = true;
+        else if(!std::strcmp("-pl", argv[2]))
+            PlaylistMode = true;
+        else if(!std::strncmp("-seq=", argv[2], 5))
+            XMISequence = std::atoi(argv[2]+5);
+        else if(!std::strncmp("-loops=", argv[2], 7))
+            LoopCount = std::atoi(argv[2]+7);
+        else if(!std::strncmp("-fade=", argv[2], 6))
+            FadeOutTime = std::atof(argv[2]+6);
+        else if(!std::strncmp("-maxlen=", argv[2], 8))
+            MaxDuration = std::atof(argv[2]+8);
+        else if(!std::strcmp("-scan=json", argv[2]))
+            ScanFormat = SCAN_JSON;
+        else if(!std::strcmp("-scan=csv", argv[2]))
+            ScanFormat = SCAN_CSV;
+        else if(!std::strcmp("-direct", argv[2]))
+            DirectMIDIInput = true;
+        else if(!std::strncmp("-ahead=", argv[2], 7))
+            RenderAheadTime = std::atof(argv[2]+7) / 1000.0;
+        else if(!std::strcmp("-stems", argv[2]))
+            CardOutputs = true;
+        else if(!std::strcmp("-nomix", argv[2]))
+            MasterMix = false;
+        else if(!std::strncmp("-ports=", argv[2], 7))
+        {
+            NumMIDIPorts = std::atoi(argv[2]+7);
+            if(NumMIDIPorts < 1 || NumMIDIPorts > MaxMIDIPorts)
+            {
+                InitMessage(12, "number of MIDI ports may only be 1..%u.\n", MaxMIDIPorts);
+                return 0;
+            }
+        }
         else break;
 
         for(int p=2; p<argc; ++p) argv[p] = argv[p+1];
         --argc;
     }
 
+    if(AnalyzeSong && PlaylistMode)
+    {
+        // The cards are set up once, before the first song is played
+        InitMessage(12, "-a cannot be used with -pl.\n");
+        return 0;
+    }
+
     if(argc >= 3)
     {
         int bankno = std::atoi(argv[2]);
@@ -1,156 +1,400 @@
-#include <vector>
-#include <string>
-#include <map>
-#include <set>
-#include <cstdlib>
-#include <cstring>
+#include "qtui.hh"
+
+#include "adldata.hh"
+#include "audiotap.hh"
+#include "config.hh"
+#include "midi_symbols_256.hh"
+#include "ringbuffer.hh"
+#include "ui.hh"
+#include "uiinterface.hh"
+
+#include <algorithm>
+#include <atomic>
 #include <cmath>
-#include <unistd.h>
-#include <stdarg.h>
 #include <cstdio>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string>
 
 #include <QApplication>
+#include <QCloseEvent>
+#include <QColor>
+#include <QEventLoop>
+#include <QFont>
+#include <QImage>
+#include <QPainter>
+#include <QTimer>
 #include <QWidget>
 
-#include "ui.hh"
+// Window updates per second
+#define QT_FRAME_RATE 30
 
 static QApplication *app;
 
-class QtConsoleInterface: public ConsoleInterface
+/* Xterm 256-color palette, as used by the terminal UI */
+static QRgb XtermColor(int index)
 {
-public:
-    QtConsoleInterface():
-      x(0), y(0), color(-1),
-      maxy(0), cursor_visible(true),
-      screen_mode(false)
+    static const QRgb basic[16] =
     {
-        std::memset(buffer, '.',    sizeof(buffer));
-        std::memset(colors, 0,      sizeof(colors));
-
-        int argc=0;
-        app = new QApplication(argc, 0);
-    }
-
-    ~QtConsoleInterface()
+        qRgb(0,0,0),     qRgb(128,0,0),   qRgb(0,128,0),   qRgb(128,128,0),
+        qRgb(0,0,128),   qRgb(128,0,128), qRgb(0,128,128), qRgb(192,192,192),
+        qRgb(128,128,128), qRgb(255,0,0), qRgb(0,255,0),   qRgb(255,255,0),
+        qRgb(0,0,255),   qRgb(255,0,255), qRgb(0,255,255), qRgb(255,255,255)
+    };
+    static const int level[6] = {0,95,135,175,215,255};
+    if(index < 16)
+        return basic[index];
+    if(index < 232)
     {
-        ShowCursor();
-        std::fputs("\33[0m", stderr);
-        std::fflush(stderr);
+        index -= 16;
+        return qRgb(level[index/36], level[index/6%6], level[index%6]);
     }
+    int gray = 8 + (index - 232) * 10;
+    return qRgb(gray, gray, gray);
+}
 
-    void InitMessage(int color, const char *message, int nchars)
-    {
-        if(screen_mode)
-            return;
-        if(color != -1)
-            Color(color);
-        std::fwrite(message, nchars, 1, stderr);
-        std::fputs("\33[0m", stderr);
-        std::fflush(stderr);
-    }
+// Color numbers of the UI: below 16 the 4-bit colors, otherwise 8-bit
+static QRgb UIColor(int color)
+{
+    static const char map[16] = {0,17,2,6,1,5,3,7,24,12,10,14,9,13,11,15};
+    return XtermColor(color < 16 ? map[color] : color);
+}
+
+/* Draws the channels in a window. The synthesizer only stores the new
+ * state of a channel with a single atomic store and never waits. A timer
+ * takes a snapshot of all channels at a fixed frame rate, renders it into
+ * an image and blits that in one go, so the drawing cost depends on
+ * neither the note density nor, beyond the snapshot, the number of cards.
+ * The output levels and spectrum are analyzed by the same timer.
+ */
+class QtUI: public QWidget, public UIInterface
+{
+public:
+    QtUI();
+    ~QtUI();
+    void PrintLn(const char* fmt, ...) __attribute__((format(printf,2,3)));
+    void IllustrateNote(int adlchn, int note, int ins, int pressure, double bend);
+    void IllustratePatchChange(int MidCh, int patch, int adlinsid);
+    void Log(LogMessage msg, int a, int b, int c, int d, const char *text);
+    void AttachAudioTap(AudioTap *tap);
+    void IllustrateChannelLevels(const float *levels, unsigned count);
+
+    bool closed;
+
+protected:
+    void timerEvent(QTimerEvent *);
+    void paintEvent(QPaintEvent *);
+    void closeEvent(QCloseEvent *event);
+
+private:
+    static const unsigned MaxChannels = MaxCards*23;
+    static const unsigned MaxMIDIChannels = MaxMIDIPorts*16;
+    static const int CellWidth = 8;
+    static const int PatchLineHeight = 12;
+    static const int NoteColumns = 77;
+    static const int LevelColumn = 79; // Measured level of each channel
+    static const int PatchColumn = 81; // First column of the patch list
+    static const unsigned SpectrumBands = 32;
+    static const int SpectrumHeight = 64; // Below the patch list
 
-    void CreateGrid(int width, int height, int *out_width, int *out_height)
+    struct Note
+    {
+        int16_t note;
+        uint8_t ins;
+        int8_t pressure; // 0 = off, -1 = released
+    };
+    struct Patch
+    {
+        int16_t patch, adlinsid;
+    };
+    struct LogEvent { int msg; int args[4]; const char *text; };
+    struct Message
     {
-        screen_mode = true;
+        enum { TEXT, LOG } type;
+        union
+        {
+            char text[80];
+            LogEvent log;
+        };
+    };
 
-        std::fputc('\r', stderr); // Ensure cursor is at x=0
-        GotoXY(0,0); Color(15);
-        std::fputs("Hit Ctrl-C to quit\r", stderr);
-        HideCursor();
+    // Published by the synthesizer
+    std::atomic<Note> notes[MaxChannels];
+    std::atomic<Patch> patches[MaxMIDIChannels];
+    std::atomic<float> levels[MaxChannels];
+    std::atomic<unsigned> num_levels;
+    MultiProducerRingBuffer<Message, 1024> messages;
 
-        *out_width = width;
-        *out_height = height;
-    }
+    // Attached and read on the main thread, like the timer runs
+    AudioTap *tap;
+    AudioAnalyzer analyzer;
+
+    // Snapshot that the current frame is drawn from
+    Note frame_notes[MaxChannels];
+    Patch frame_patches[MaxMIDIChannels];
+
+    QImage image;
+    int rows, row_height;
+
+    void Layout();
+    void Render();
+    void FillCell(int column, int row, QRgb color);
+};
+
+static QtUI *qt_ui;
+
+QtUI::QtUI():
+    closed(false),
+    num_levels(0),
+    tap(0)
+{
+    const Note no_note = {0, 0, 0};
+    const Patch no_patch = {-1, -1};
+    for(unsigned c = 0; c < MaxChannels; ++c)
+        notes[c].store(no_note, std::memory_order_relaxed);
+    for(unsigned c = 0; c < MaxMIDIChannels; ++c)
+        patches[c].store(no_patch, std::memory_order_relaxed);
+
+    Layout();
+    setWindowTitle("ADLMIDI");
+    setAttribute(Qt::WA_OpaquePaintEvent);
+    show();
+    startTimer(1000 / QT_FRAME_RATE);
+}
+
+QtUI::~QtUI()
+{
+    qt_ui = 0;
+}
+
+void QtUI::PrintLn(const char* fmt, ...)
+{
+    Message m;
+    m.type = Message::TEXT;
+    va_list ap;
+    va_start(ap, fmt);
+    int nchars = vsnprintf(m.text, sizeof(m.text), fmt, ap);
+    va_end(ap);
+
+    if(nchars <= 0) return;
+    messages.Push(m);
+}
+
+void QtUI::Log(LogMessage msg, int a, int b, int c, int d, const char *text)
+{
+    Message m;
+    m.type = Message::LOG;
+    LogEvent l = {msg, {a, b, c, d}, text};
+    m.log = l;
+    messages.Push(m);
+}
+
+void QtUI::IllustrateNote(int adlchn, int note, int ins, int pressure, double)
+{
+    if(adlchn < 0 || (unsigned)adlchn >= MaxChannels)
+        return;
+    Note n = {(int16_t)note, (uint8_t)ins, (int8_t)std::min(pressure, 127)};
+    notes[adlchn].store(n, std::memory_order_relaxed);
+}
+
+void QtUI::AttachAudioTap(AudioTap *new_tap)
+{
+    tap = new_tap;
+}
+
+void QtUI::IllustrateChannelLevels(const float *new_levels, unsigned count)
+{
+    count = std::min(count, MaxChannels);
+    for(unsigned c = 0; c < count; ++c)
+        levels[c].store(new_levels[c], std::memory_order_relaxed);
+    num_levels.store(count, std::memory_order_relaxed);
+}
 
-    void Draw(int notex,int notey, int color, char ch)
+void QtUI::IllustratePatchChange(int MidCh, int patch, int adlinsid)
+{
+    if(MidCh < 0 || (unsigned)MidCh >= MaxMIDIChannels)
+        return;
+    Patch p = {(int16_t)patch, (int16_t)adlinsid};
+    patches[MidCh].store(p, std::memory_order_relaxed);
+}
+
+void QtUI::timerEvent(QTimerEvent *)
+{
+    // Messages go to the terminal, which the window leaves free
+    for(Message *m; (m = messages.Front()) != 0; messages.Pop())
     {
-        if(buffer[notex][notey] != ch
-        || colors[notex][notey] != color)
+        if(m->type == Message::TEXT)
+            InitMessage(-1, "%s\n", m->text);
+        else
         {
-            buffer[notex][notey] = ch;
-            colors[notex][notey] = color;
-            GotoXY(notex, notey);
-            Color(color);
-            std::fputc(ch, stderr);
-            ++x;
+            char line[256];
+            if(FormatLogMessage(line, sizeof(line), m->log.msg, m->log.args, m->log.text) > 0)
+                InitMessage(-1, "%s\n", line);
         }
     }
+    Render();
+    update();
+}
+
+void QtUI::paintEvent(QPaintEvent *)
+{
+    QPainter painter(this);
+    painter.drawImage(0, 0, image);
+}
+
+void QtUI::closeEvent(QCloseEvent *event)
+{
+    closed = true;
+    event->accept();
+}
+
+/* Size the image for the current number of cards */
+void QtUI::Layout()
+{
+    // Without percussion mode, the last 5 channels of each chip are unused
+    rows = NumCards * (AdlPercussionMode ? 23 : 18);
+    row_height = std::max(1, 720 / rows);
+    image = QImage(MaxWidth * CellWidth, std::max(rows * row_height, 16 * PatchLineHeight + SpectrumHeight),
+                   QImage::Format_RGB32);
+    image.fill(XtermColor(0));
+    setFixedSize(image.size());
+}
+
+void QtUI::FillCell(int column, int row, QRgb color)
+{
+    if(column < 0 || row < 0 || (column + 1) * CellWidth > image.width()
+    || (row + 1) * row_height > image.height())
+        return;
+    for(int y = row * row_height; y < (row + 1) * row_height; ++y)
+    {
+        QRgb *line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        std::fill(line + column * CellWidth, line + (column + 1) * CellWidth, color);
+    }
+}
 
-    void Flush()
+void QtUI::Render()
+{
+    // The song may have changed the number of cards, see -a
+    if(rows != (int)(NumCards * (AdlPercussionMode ? 23 : 18)))
+        Layout();
+    const unsigned channels = NumCards * 23;
+    for(unsigned c = 0; c < channels; ++c)
+        frame_notes[c] = notes[c].load(std::memory_order_relaxed);
+    for(unsigned c = 0; c < MaxMIDIChannels; ++c)
+        frame_patches[c] = patches[c].load(std::memory_order_relaxed);
+    if(tap)
+        analyzer.Update(tap);
+    double amp[2];
+    for(unsigned w = 0; w < 2; ++w)
     {
-        std::fflush(stderr);
+        // Same logarithmic scale as the terminal UI
+        const double level = analyzer.rms[w] * 32767;
+        amp[w] = std::log(level < 1 ? 1 : level) * 4.328085123 / 48 * rows;
     }
 
-private:
-    int x, y, color, maxy;
-    char buffer[MaxWidth][MaxHeight];
-    unsigned char colors[MaxWidth][MaxHeight];
-    bool cursor_visible;
-    bool screen_mode;
+    image.fill(XtermColor(0));
+
+    // Volume bars, colored like the terminal UI
+    for(int y = 0; y < rows; ++y)
+        for(unsigned w = 0; w < 2; ++w)
+            if(amp[w] > (rows-1) - y)
+                FillCell(w, y, UIColor(y < rows/23 ? 15
+                                     : y < rows*4/23 ? 12
+                                     : y < rows*8/23 ? 14 : 10));
 
-    void HideCursor()
+    // Measured channel levels as shades of gray, same scale as the VU
+    const unsigned num_frame_levels = std::min(num_levels.load(std::memory_order_relaxed), channels);
+    for(unsigned c = 0; c < num_frame_levels; ++c)
     {
-        if(!cursor_visible) return;
-        cursor_visible = false;
-        std::fputs("\33[?25l", stderr); // hide cursor
+        if(!AdlPercussionMode && c % 23 >= 18)
+            continue;
+        const double level = levels[c].load(std::memory_order_relaxed) * 32767;
+        const double amp = std::log(level < 1 ? 1 : level) * 4.328085123 / 48;
+        if(amp > 0)
+            FillCell(LevelColumn, AdlPercussionMode ? c : (c / 23) * 18 + (c % 23),
+                     XtermColor(232 + std::min(23, int(amp * 24))));
     }
 
-    void ShowCursor()
+    for(unsigned c = 0; c < channels; ++c)
     {
-        if(cursor_visible) return;
-        cursor_visible = true;
-        GotoXY(0,maxy); Color(7);
-        std::fputs("\33[?25h", stderr); // show cursor
-        std::fflush(stderr);
+        const Note &n = frame_notes[c];
+        if(!n.pressure || (!AdlPercussionMode && c % 23 >= 18))
+            continue;
+        const int row = AdlPercussionMode ? c : (c / 23) * 18 + (c % 23);
+        const int column = 2 + (n.note + 55) % NoteColumns;
+        if(column < 2)
+            continue;
+        FillCell(column, row, n.pressure > 0 ? XtermColor(MIDIcolors256[n.ins]) : UIColor(8));
     }
 
-    // Move tty cursor to the indicated position.
-    // Movements will be done in relative terms
-    // to the current cursor position only.
-    void GotoXY(int newx, int newy)
+    // Spectrum below the patch list, from -60 dB to full scale
+    QPainter painter(&image);
+    float bands[SpectrumBands];
+    analyzer.Spectrum(bands, SpectrumBands);
+    const int spectrum_x = PatchColumn * CellWidth;
+    const int band_width = (image.width() - spectrum_x) / SpectrumBands;
+    for(unsigned b = 0; b < SpectrumBands; ++b)
     {
-        if(newy > maxy || (newy > y && (newy-y)<4 && newx == 0))
-        {
-            while(newy > y)
-            {
-                std::fputc('\n', stderr); y+=1; x=0;
-            }
-        }
-        if(newy > maxy)
-            maxy = newy;
-        if(newy < y) { std::fprintf(stderr, "\33[%dA", y-newy); y = newy; }
-        if(newy > y) { std::fprintf(stderr, "\33[%dB", newy-y); y = newy; }
-        if(newx != x)
-        {
-            if(newx == 0 || (newx<10 && std::abs(newx-x)>=10))
-                { std::fputc('\r', stderr); x = 0; }
-            if(newx < x) std::fprintf(stderr, "\33[%dD", x-newx);
-            if(newx > x) std::fprintf(stderr, "\33[%dC", newx-x);
-            x = newx;
-        }
+        const int h = std::max(0, std::min(SpectrumHeight, int((bands[b] + 60) * SpectrumHeight / 60)));
+        painter.fillRect(spectrum_x + b * band_width, image.height() - h, band_width - 1, h,
+                         QColor(UIColor(bands[b] > -6 ? 12 : bands[b] > -20 ? 14 : 10)));
     }
 
-    // Set color (4-bit or 8-bit). Bits: 1=blue, 2=green, 4=red, 8=+intensity
-    void Color(int newcolor)
+    // Patch of every MIDI channel in use, as many as fit
+    QFont font("monospace");
+    font.setPixelSize(PatchLineHeight - 2);
+    painter.setFont(font);
+    int y = 0;
+    for(unsigned ch = 0; ch < MaxMIDIChannels && y + PatchLineHeight <= image.height() - SpectrumHeight; ++ch)
     {
-        if(color != newcolor)
+        const Patch &p = frame_patches[ch];
+        if(p.patch < 0)
+            continue;
+        std::string name = "[unnamed]";
+        int color = 1;
+        if(p.adlinsid >= 0)
         {
-            if(newcolor<16)
+            if(adlins[p.adlinsid].name)
+                name = adlins[p.adlinsid].name;
+            if(!(adlins[p.adlinsid].flags & adlinsdata::Flag_NoSound))
             {
-                static const char map[16] = {0,17,2,6,1,5,3,7,24,12,10,14,9,13,11,15};
-                std::fprintf(stderr, "\33[0;38;5;%im", map[newcolor]);
+                if(adlins[p.adlinsid].adlno1 != adlins[p.adlinsid].adlno2)
+                    color = (adlins[p.adlinsid].flags & adlinsdata::Flag_Pseudo4op) ? 9 : 11;
+                else
+                    color = 8;
             }
-            else
-            {
-                std::fprintf(stderr, "\33[0;38;5;%im", newcolor);
-            }
-            color = newcolor;
         }
+        char label[16];
+        std::snprintf(label, sizeof(label), "%02u %03d", ch, p.patch);
+        const int x = PatchColumn * CellWidth;
+        painter.setPen(QColor(UIColor(8)));
+        painter.drawText(x, y + PatchLineHeight - 2, label);
+        painter.fillRect(x + 7 * CellWidth, y + 1, CellWidth, PatchLineHeight - 2,
+                         QColor(XtermColor(MIDIcolors256[p.patch & 0xFF])));
+        painter.setPen(QColor(UIColor(color)));
+        painter.drawText(x + 9 * CellWidth, y + PatchLineHeight - 2, QString::fromLatin1(name.c_str()));
+        y += PatchLineHeight;
     }
-};
+}
 
-ConsoleInterface *CreateQtConsole()
+UIInterface *CreateQtUI()
 {
-    return new QtConsoleInterface();
+    static int argc = 1;
+    static char name[] = "adlmidi";
+    static char *argv[] = {name, 0};
+    if(!app)
+    {
+        app = new QApplication(argc, argv);
+        app->setQuitOnLastWindowClosed(false);
+    }
+    qt_ui = new QtUI();
+    return qt_ui;
 }
 
+bool RunQtUI(int ms)
+{
+    QEventLoop loop;
+    QTimer::singleShot(ms, &loop, SLOT(quit()));
+    loop.exec();
+    return qt_ui && !qt_ui->closed;
+}
@@ -0,0 +1,16 @@
+#ifndef H_QTUI
+#define H_QTUI
+
+class UIInterface;
+
+/* Qt front-end, available when built with Qt (USE_QT).
+ * Shows the channels in a window instead of on the terminal.
+ * Both functions must be called from the main thread.
+ */
+UIInterface *CreateQtUI();
+/* Handle window events for ms milliseconds. Returns false when the
+ * window has been closed.
+ */
+bool RunQtUI(int ms);
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef H_RINGBUFFER
+#define H_RINGBUFFER
+
+#include <atomic>
+#include <vector>
+
+/** Bounded single-producer, single-consumer queue.
+ * Push is only called from one thread and Front/Pop from one other
+ * (possibly the same) thread. Neither side ever blocks or allocates,
+ * which makes it safe to use from the audio thread.
+ * Size must be a power of two.
+ */
+template<typename T, unsigned Size>
+class RingBuffer
+{
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+
+    T buffer[Size];
+    std::atomic<unsigned> head;      // Next entry to read, written by consumer
+    std::atomic<unsigned> tail;      // Next entry to write, written by producer
+    std::atomic<unsigned> overflows; // Entries dropped because the queue was full
+public:
+    RingBuffer(): head(0), tail(0), overflows(0) { }
+
+    /* Producer: add an entry, returns false if the queue is full */
+    bool Push(const T& item)
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == Size)
+        {
+            overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        buffer[t & (Size - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    /* Consumer: oldest entry, or NULL if the queue is empty */
+    T* Front()
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire))
+            return 0;
+        return &buffer[h & (Size - 1)];
+    }
+    /* Consumer: remove the oldest entry, which must exist */
+    void Pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    /* Number of entries dropped so far */
+    unsigned Overflows() const
+    {
+        return overflows.load(std::memory_order_relaxed);
+    }
+};
+
+/** Bounded multi-producer, single-consumer queue, with the same interface
+ * as RingBuffer. Push may be called from any number of threads. A producer
+ * never waits for another one that is preempted halfway, it only retries
+ * when it loses a race for the same slot; this keeps the audio thread
+ * safe even when other threads push too.
+ * Size must be a power of two.
+ */
+template<typename T, unsigned Size>
+class MultiProducerRingBuffer
+{
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of two");
+
+    struct Slot
+    {
+        std::atomic<unsigned> sequence; // Equals the position when free, position+1 when filled
+        T item;
+    };
+    Slot buffer[Size];
+    unsigned head;                   // Next entry to read, consumer only
+    std::atomic<unsigned> tail;      // Next entry to claim by a producer
+    std::atomic<unsigned> overflows; // Entries dropped because the queue was full
+public:
+    MultiProducerRingBuffer(): head(0), tail(0), overflows(0)
+    {
+        for(unsigned i = 0; i < Size; ++i)
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /* Producer: add an entry, returns false if the queue is full */
+    bool Push(const T& item)
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            Slot &slot = buffer[t & (Size - 1)];
+            int diff = (int)(slot.sequence.load(std::memory_order_acquire) - t);
+            if(diff == 0)
+            {
+                if(tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed))
+                {
+                    slot.item = item;
+                    slot.sequence.store(t + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+            {
+                overflows.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            else
+                t = tail.load(std::memory_order_relaxed);
+        }
+    }
+    /* Consumer: oldest entry, or NULL if the queue is empty */
+    T* Front()
+    {
+        Slot &slot = buffer[head & (Size - 1)];
+        if(slot.sequence.load(std::memory_order_acquire) != head + 1)
+            return 0;
+        return &slot.item;
+    }
+    /* Consumer: remove the oldest entry, which must exist */
+    void Pop()
+    {
+        buffer[head & (Size - 1)].sequence.store(head + Size, std::memory_order_release);
+        ++head;
+    }
+    /* Number of entries dropped so far */
+    unsigned Overflows() const
+    {
+        return overflows.load(std::memory_order_relaxed);
+    }
+};
+
+/** Single-producer, single-consumer FIFO of stereo sample frames, with
+ * a capacity chosen at run time. Like RingBuffer, neither side blocks
+ * or allocates after construction.
+ */
+class FrameRingBuffer
+{
+    std::vector<float> buffer[2]; // Left and right channel
+    unsigned mask;
+    std::atomic<unsigned> head; // Next frame to read, written by consumer
+    std::atomic<unsigned> tail; // Next frame to write, written by producer
+public:
+    /* Capacity is frames rounded up to a power of two */
+    FrameRingBuffer(unsigned frames): head(0), tail(0)
+    {
+        unsigned size = 1;
+        while(size < frames)
+            size *= 2;
+        buffer[0].resize(size);
+        buffer[1].resize(size);
+        mask = size - 1;
+    }
+
+    unsigned Capacity() const { return mask + 1; }
+    /* Number of frames that can be read */
+    unsigned Available() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+    /* Number of frames that can be written */
+    unsigned Space() const { return Capacity() - Available(); }
+
+    /* Producer: append count frames, which must fit in Space() */
+    void Write(const float *left, const float *right, unsigned count)
+    {
+        unsigned t = tail.load(std::memory_order_relaxed);
+        for(unsigned a = 0; a < count; ++a)
+        {
+            buffer[0][(t + a) & mask] = left[a];
+            buffer[1][(t + a) & mask] = right[a];
+        }
+        tail.store(t + count, std::memory_order_release);
+    }
+    /* Consumer: take up to count frames, step floats apart in the
+     * destination; returns the number of frames read */
+    unsigned Read(float *left, float *right, int step, unsigned count)
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        unsigned avail = tail.load(std::memory_order_acquire) - h;
+        if(count > avail)
+            count = avail;
+        for(unsigned a = 0; a < count; ++a)
+        {
+            left[a*step] = buffer[0][(h + a) & mask];
+            right[a*step] = buffer[1][(h + a) & mask];
+        }
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+};
+
+#endif
@@ -3,15 +3,17 @@
 #include "config.hh"
 #include "midievt.hh"
 #include "parseargs.hh"
+#include "ringbuffer.hh"
 #include "sync.hh"
 #include "ui.hh"
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <deque>  // deque
 #include <map>
 #include <set>
 #include <signal.h>
@@ -23,19 +25,52 @@
 #include <alsa/asoundlib.h>
 
 static volatile sig_atomic_t QuitFlag = false;
+static volatile sig_atomic_t ReportFlag = false;
 volatile int ExitSignal = 0;
 const uint64_t NANOS_PER_S = 1000000000LL;
 
 // Add this number of samples to time for new midi events to make sure that
-// events arrive in the future so to preserve relative timing.
+// events arrive in the future so to preserve relative timing. This is the
+// starting value, the delay adapts to what is measured at runtime.
 static const int MIDI_DELAY_FRAMES = 2000;
+// Fraction of events that should be in the future when they are processed
+static const double MIDI_ON_TIME_TARGET = 0.999;
 
 static void TidyupAndExit(int signal)
 {
     QuitFlag = true;
     ExitSignal = signal;
 }
+static void RequestReport(int)
+{
+    ReportFlag = true;
+}
+
+/* Comparison functions with 32-bit wrap-around */
+// Return max(to - from, 0)
+uint32_t SamplesDiff(uint32_t to, uint32_t from)
+{
+    uint32_t timeDiff = to - from;
+    if(timeDiff > 0x80000000) // Event is in the past!
+        return 0;
+    else
+        return timeDiff;
+}
+// Return to - from
+int32_t SamplesSignedDiff(uint32_t to, uint32_t from)
+{
+    return to - from; // XXX does this use undefined behavior?
+}
+// Return true if to > from, false otherwise
+bool SamplesLargerThan(uint32_t to, uint32_t from) { return (from - to) > 0x80000000; }
+// Return true if to < from, false otherwise
+bool SamplesSmallerThan(uint32_t to, uint32_t from) { return (to - from) > 0x80000000; }
 
+/** Queue of timestamped MIDI events for the audio thread.
+ * Events come either from the listener thread or from the audio thread
+ * itself (JACK MIDI), each through its own lock-free ring, so that the
+ * audio thread never waits for a lock or allocates memory.
+ */
 class MidiEventQueue
 {
 private:
@@ -49,25 +84,42 @@ private:
          * entry in sysex queue (not implemented) */
         uint8_t data[3];
     };
-    typedef std::vector<uint8_t> MidiSysExData;
+    typedef RingBuffer<MidiEvent, 4096> MidiEventRing;
+
+    MidiEventRing input; // ALSA input, from the listener or the audio thread
+    MidiEventRing local; // JACK MIDI input, from the audio thread
+    std::atomic<uint32_t> render_end;
+    std::atomic<unsigned> late_events;
 
-    std::deque<MidiEvent> eventqueue;
-    MutexType mutex;
+    MidiEvent *Next();
+    MidiEventRing& Ring(bool from_audio_thread) { return from_audio_thread ? local : input; }
 public:
     MidiEventQueue();
     ~MidiEventQueue();
 
-    void PushEvent(uint32_t timestamp, int port, const unsigned char *data, unsigned length);
+    void PushEvent(uint32_t timestamp, int port, const unsigned char *data, unsigned length, bool from_audio_thread = false);
     bool PeekEvent(uint32_t &nextEventTime);
     bool ProcessEvent(MIDIeventhandler *evh);
+    /* Number of events dropped because the queue was full */
+    unsigned Overflows() const { return input.Overflows() + local.Overflows(); }
+    /* Audio thread: set the sample time up to which the current chunk is
+     * rendered. An event for an earlier time that arrives now will be late.
+     */
+    void SetRenderEnd(uint32_t samples) { render_end.store(samples, std::memory_order_relaxed); }
+    uint32_t RenderEnd() const { return render_end.load(std::memory_order_relaxed); }
+    /* Audio thread: count an event that was processed after its time */
+    void CountLate() { late_events.fetch_add(1, std::memory_order_relaxed); }
+    unsigned LateEvents() const { return late_events.load(std::memory_order_relaxed); }
 };
-MidiEventQueue::MidiEventQueue()
+MidiEventQueue::MidiEventQueue():
+    render_end(0),
+    late_events(0)
 {
 }
 MidiEventQueue::~MidiEventQueue()
 {
 }
-void MidiEventQueue::PushEvent(uint32_t timestamp, int port, const unsigned char *data, unsigned length)
+void MidiEventQueue::PushEvent(uint32_t timestamp, int port, const unsigned char *data, unsigned length, bool from_audio_thread)
 {
     if(length==0 || length>3)
         return;
@@ -76,40 +128,34 @@ void MidiEventQueue::PushEvent(uint32_t timestamp, int port, const unsigned char
     evt.port = port;
     memcpy(evt.data, data, length);
     //printf("Inserting event: %i %02x %02x %02x\n", (int)timestamp, evt.byte, evt.data[0], evt.data[1]);
-    mutex.Lock();
-    eventqueue.push_back(evt);
-    mutex.Unlock();
+    Ring(from_audio_thread).Push(evt);
+}
+/* Earliest event of the two rings */
+MidiEventQueue::MidiEvent *MidiEventQueue::Next()
+{
+    MidiEvent *a = input.Front(), *b = local.Front();
+    if(!a || (b && SamplesSmallerThan(b->timestamp, a->timestamp)))
+        return b;
+    return a;
 }
 bool MidiEventQueue::PeekEvent(uint32_t &nextEventTime)
 {
-    bool rv = false;
-    mutex.Lock();
-    if(!eventqueue.empty())
-    {
-        nextEventTime = eventqueue.front().timestamp;
-        rv = true;
-    }
-    mutex.Unlock();
-    return rv;
+    MidiEvent *evt = Next();
+    if(!evt)
+        return false;
+    nextEventTime = evt->timestamp;
+    return true;
 }
 bool MidiEventQueue::ProcessEvent(MIDIeventhandler *evh)
 {
-    bool rv = false;
-    MidiEvent evt;
-    mutex.Lock();
-    if(!eventqueue.empty())
-    {
-        evt = eventqueue.front();
-        eventqueue.pop_front();
-        rv = true;
-    }
-    mutex.Unlock();
-    if(!rv)
+    MidiEvent *evt = Next();
+    if(!evt)
         return false;
 
     //printf("Processing event: %i port=%02x %02x %02x %02x length=%i\n", evt.timestamp, evt.port, evt.byte, evt.data[0], evt.data[1],
     //        MidiEventLength(evt.byte));
-    evh->HandleEvent(evt.port, evt.data, MidiEventLength(evt.data[0]));
+    evh->HandleEvent(evt->port, evt->data, MidiEventLength(evt->data[0]));
+    Ring(evt == local.Front()).Pop();
     return true;
 }
 
@@ -120,31 +166,29 @@ uint64_t GetTimeNanos()
     return tv.tv_sec * NANOS_PER_S + tv.tv_nsec;
 }
 
-/* Comparison functions with 32-bit wrap-around */
-// Return max(to - from, 0)
-uint32_t SamplesDiff(uint32_t to, uint32_t from)
-{
-    uint32_t timeDiff = to - from;
-    if(timeDiff > 0x80000000) // Event is in the past!
-        return 0;
-    else
-        return timeDiff;
-}
-// Return to - from
-int32_t SamplesSignedDiff(uint32_t to, uint32_t from)
-{
-    return to - from; // XXX does this use undefined behavior?
-}
-// Return true if to > from, false otherwise
-bool SamplesLargerThan(uint32_t to, uint32_t from) { return (from - to) > 0x80000000; }
-// Return true if to < from, false otherwise
-bool SamplesSmallerThan(uint32_t to, uint32_t from) { return (to - from) > 0x80000000; }
-
+/** Map wall-clock time to the sample position of the audio output.
+ * The mapping is corrected by a delay-locked loop at every Sync, which
+ * follows the actual rate of the audio device instead of jumping.
+ */
 class Clock
 {
+    // Where the audio output was at a certain time, and how fast it goes
+    struct State
+    {
+        double time;             // nanos
+        uint32_t samples;
+        double nanos_per_sample;
+    };
     UI *ui;
-    uint64_t start_time;
     unsigned int sample_rate;
+    // Written by the audio thread only, read through a sequence lock
+    State state;
+    std::atomic<unsigned> sequence;
+    bool locked;
+    std::atomic<double> jitter;  // samples
+
+    State Load() const;
+    void Store(const State& s);
 public:
     /* Pass value 'ahead' (in nanos) to take audio buffer into account */
     Clock(uint64_t ahead, unsigned int sample_rate, UI *ui);
@@ -154,18 +198,53 @@ public:
      * at the receiving end.
      */
     void Sync(uint32_t cur_samples);
+    /* Recent peak difference between the loop and the audio callbacks, in samples */
+    double Jitter() const { return jitter; }
+    /* Measured sample rate of the audio device */
+    double MeasuredRate() const { return NANOS_PER_S / Load().nanos_per_sample; }
 };
 
+// Bandwidth of the delay-locked loop in Hz
+static const double CLOCK_DLL_BANDWIDTH = 0.5;
+// Factor by which the jitter peak decays at each sync
+static const double CLOCK_JITTER_DECAY = 0.995;
+
 Clock::Clock(uint64_t ahead, unsigned int sample_rate, UI *ui):
     ui(ui),
-    start_time(GetTimeNanos() - ahead),
-    sample_rate(sample_rate)
+    sample_rate(sample_rate),
+    sequence(0),
+    locked(false),
+    jitter(0)
+{
+    state.time = GetTimeNanos() - ahead;
+    state.samples = 0;
+    state.nanos_per_sample = NANOS_PER_S / (double)sample_rate;
+}
+
+Clock::State Clock::Load() const
+{
+    State s;
+    unsigned seq;
+    do {
+        seq = sequence.load(std::memory_order_acquire);
+        s = state;
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while((seq & 1) || seq != sequence.load(std::memory_order_relaxed));
+    return s;
+}
+
+void Clock::Store(const State& s)
 {
+    sequence.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    state = s;
+    sequence.fetch_add(1, std::memory_order_release);
 }
 
 uint32_t Clock::NanosToSamples(uint64_t nanos)
 {
-    return (nanos - start_time) * sample_rate / NANOS_PER_S;
+    State s = Load();
+    return s.samples + (int64_t)floor((nanos - s.time) / s.nanos_per_sample);
 }
 
 uint32_t Clock::CurrentSamples()
@@ -175,13 +254,114 @@ uint32_t Clock::CurrentSamples()
 
 void Clock::Sync(uint32_t out_samples)
 {
-    uint64_t clk_samples = CurrentSamples();
-    int32_t difference = SamplesSignedDiff(clk_samples, out_samples);
-    if(abs(difference) > 1000) /// Require a minimum threshold before adjusting to avoid jitter
+    const double now = GetTimeNanos();
+    State s = state; // Only this thread writes the state
+    int32_t n = SamplesSignedDiff(out_samples, s.samples);
+    // Time at which the loop expected the output to reach out_samples
+    double predicted = s.time + n * s.nanos_per_sample;
+    double error = now - predicted;
+    double difference = error / s.nanos_per_sample;
+    if(!locked || n <= 0 || fabs(difference) > sample_rate / 10)
+    {
+        // Start over after startup, a stall or a jump in the output
+        if(locked)
+            ui->PrintLn("Clock sync lost, correcting difference of %d samples", (int)difference);
+        s.time = now;
+        s.nanos_per_sample = NANOS_PER_S / (double)sample_rate;
+        locked = true;
+    }
+    else
+    {
+        // Second order loop, with coefficients for the time since the last sync
+        const double omega = 2 * M_PI * CLOCK_DLL_BANDWIDTH * n / sample_rate;
+        s.time = predicted + M_SQRT2 * omega * error;
+        s.nanos_per_sample += omega * omega * error / n;
+        jitter = std::max(fabs(difference), jitter * CLOCK_JITTER_DECAY);
+    }
+    s.samples = out_samples;
+    Store(s);
+}
+
+/** Choose the delay added to incoming events, so that the target fraction
+ * of them is still in the future when the audio thread gets to them.
+ * For each event, the listener thread measures how much delay it would
+ * have needed. The delay follows a percentile of the recent measurements:
+ * it grows at once, and shrinks a few samples per event.
+ */
+class LatencyEstimator
+{
+    enum { BucketSize = 16, NumBuckets = 512 }; // Up to 8192 samples
+    // Rather than fading all buckets at each measurement, each new
+    // measurement is added with a weight that grows by 1/LATENCY_DECAY
+    double histogram[NumBuckets];
+    double total, weight;
+    int percentile; // Bucket the delay is taken from
+    double late;    // Weight of the buckets above it
+    std::atomic<int> delay;
+
+    void Renormalize();
+public:
+    LatencyEstimator(int initial_delay);
+    /* Add a measurement, in samples, and adapt the delay */
+    void AddMargin(int32_t needed);
+    /* Current delay in samples */
+    int Delay() const { return delay; }
+};
+
+// Factor by which older measurements fade at each new one
+static const double LATENCY_DECAY = 0.999;
+// Weight at which the histogram is scaled back, about every 230000 events
+static const double LATENCY_MAX_WEIGHT = 1e100;
+// Largest step in samples by which the delay shrinks per event
+static const int LATENCY_MAX_SHRINK = 8;
+
+LatencyEstimator::LatencyEstimator(int initial_delay):
+    total(0), weight(1),
+    percentile(0), late(0),
+    delay(initial_delay)
+{
+    for(unsigned a=0; a<NumBuckets; ++a)
+        histogram[a] = 0;
+}
+
+void LatencyEstimator::Renormalize()
+{
+    late = 0;
+    for(int a=0; a<NumBuckets; ++a)
     {
-        start_time += (int64_t)difference * NANOS_PER_S / sample_rate;
-        ui->PrintLn("Clock sync correcting difference of %d samples", difference);
+        histogram[a] /= weight;
+        if(a > percentile)
+            late += histogram[a];
     }
+    total /= weight;
+    weight = 1;
+}
+
+void LatencyEstimator::AddMargin(int32_t needed)
+{
+    int bucket = std::min(std::max(needed, 0) / BucketSize, NumBuckets - 1);
+    weight /= LATENCY_DECAY;
+    histogram[bucket] += weight;
+    total += weight;
+    if(bucket > percentile)
+        late += weight;
+    if(weight > LATENCY_MAX_WEIGHT)
+        Renormalize();
+
+    // Smallest delay that the target fraction of measurements fit in,
+    // found from the previous one
+    const double allowed_late = total * (1.0 - MIDI_ON_TIME_TARGET);
+    while(percentile < NumBuckets - 1 && late > allowed_late)
+        late -= histogram[++percentile];
+    while(percentile > 0 && late + histogram[percentile] <= allowed_late)
+        late += histogram[percentile--];
+    int target = (percentile + 1) * BucketSize;
+
+    int current = delay;
+    if(target > current)
+        delay = target;
+    else
+        delay = current - std::min(current - target, LATENCY_MAX_SHRINK);
 }
 
 /* Listen to ALSA Midi events */
@@ -191,21 +371,36 @@ public:
     AlsaSeqListener(Clock *midiclock, MidiEventQueue *midiqueue);
     ~AlsaSeqListener();
 
-    /* Start listening to ALSA events */
+    /* Start listening to ALSA events in a separate thread */
     void Start();
+    /* Start listening to ALSA events without a thread. Poll must then be
+     * called from the audio thread at the start of every block.
+     */
+    void StartDirect(unsigned int sample_rate);
+    /* Take the events that arrived during the last block, and queue them
+     * at the same offsets within the block that starts at block_start.
+     */
+    void Poll(uint32_t block_start, unsigned long count);
     /* Stop listening to ALSA events */
     void Stop();
+    /* Delay in samples currently added to incoming events */
+    int Delay() const { return latency.Delay(); }
 private:
     Clock *midiclock;
     MidiEventQueue *midiqueue;
+    LatencyEstimator latency;
     SDL_Thread *alsa_thread;
     volatile bool terminate;
     snd_seq_t *seq;
     snd_midi_event_t *midi_enc;
+    int port;
+    int queue; // Timestamps events in direct mode
+    unsigned int sample_rate;
 
     void Run();
     void init_seq();
     void create_port();
+    void enable_timestamps();
     void handle_alsa_event(uint32_t timestamp, const snd_seq_event_t *ev);
 
     friend int AlsaThread(void*);
@@ -259,6 +454,30 @@ void AlsaSeqListener::create_port()
                      SND_SEQ_PORT_TYPE_MIDI_GENERIC |
                      SND_SEQ_PORT_TYPE_APPLICATION);
     check_snd("create port", err);
+    port = err;
+}
+
+/* Have ALSA stamp incoming events with the time they arrived */
+void AlsaSeqListener::enable_timestamps()
+{
+    int err;
+    snd_seq_port_info_t *pinfo;
+
+    queue = snd_seq_alloc_named_queue(seq, "adlmidi");
+    check_snd("create queue", queue);
+
+    snd_seq_port_info_alloca(&pinfo);
+    err = snd_seq_get_port_info(seq, port, pinfo);
+    check_snd("get port info", err);
+    snd_seq_port_info_set_timestamping(pinfo, 1);
+    snd_seq_port_info_set_timestamp_real(pinfo, 1);
+    snd_seq_port_info_set_timestamp_queue(pinfo, queue);
+    err = snd_seq_set_port_info(seq, port, pinfo);
+    check_snd("set port timestamping", err);
+
+    err = snd_seq_start_queue(seq, queue, NULL);
+    check_snd("start queue", err);
+    snd_seq_drain_output(seq);
 }
 
 /**
@@ -274,7 +493,7 @@ void AlsaSeqListener::create_port()
  * AudioStream::estimateMIDITimestamp(nanos) called to determine at what time to insert the event into the queue
  * -> this converts nanos to samples.
  * Define midi event type with timestamp in samples and either embedded data or pointer to sysex (or ignore sysex for now).
- * Use a std::deque as event queue, or a ring buffer, protected by mutex.
+ * Use a lock-free ring buffer per producing thread as event queue.
  */
 void AlsaSeqListener::handle_alsa_event(uint32_t timestamp, const snd_seq_event_t *ev)
 {
@@ -311,10 +530,14 @@ int AlsaThread(void *listener)
 AlsaSeqListener::AlsaSeqListener(Clock *midiclock, MidiEventQueue *midiqueue):
     midiclock(midiclock),
     midiqueue(midiqueue),
+    latency(MIDI_DELAY_FRAMES),
     alsa_thread(0),
     terminate(false),
     seq(0),
-    midi_enc(0)
+    midi_enc(0),
+    port(0),
+    queue(-1),
+    sample_rate(0)
 {
 }
 
@@ -337,14 +560,50 @@ void AlsaSeqListener::Start()
     terminate = false;
 }
 
+void AlsaSeqListener::StartDirect(unsigned int sample_rate)
+{
+    int err;
+    this->sample_rate = sample_rate;
+    init_seq();
+    create_port();
+    enable_timestamps();
+    err = snd_seq_nonblock(seq, 1);
+    check_snd("set nonblock mode", err);
+    InitMessage(-1, "Waiting for data at port %d:0, read from the audio thread.\n",
+           snd_seq_client_id(seq));
+}
+
+void AlsaSeqListener::Poll(uint32_t block_start, unsigned long count)
+{
+    snd_seq_queue_status_t *status;
+    snd_seq_queue_status_alloca(&status);
+    if(snd_seq_get_queue_status(seq, queue, status) < 0)
+        return;
+    const snd_seq_real_time_t *now = snd_seq_queue_status_get_real_time(status);
+    snd_seq_event_t *event;
+    while(snd_seq_event_input(seq, &event) >= 0 && event)
+    {
+        // An event that arrived one block ago goes at the start of this block
+        double age = (double)now->tv_sec - event->time.time.tv_sec
+                   + ((double)now->tv_nsec - event->time.time.tv_nsec) * 1e-9;
+        long offset = count - (long)floor(age * sample_rate);
+        offset = std::min(std::max(offset, 0l), (long)count - 1);
+        handle_alsa_event(block_start + offset, event);
+    }
+}
+
 void AlsaSeqListener::Stop()
 {
     if(seq == 0)
         return;
     terminate = true;
-    SDL_WaitThread(alsa_thread, NULL);
+    if(alsa_thread)
+        SDL_WaitThread(alsa_thread, NULL);
     alsa_thread = 0;
+    if(queue >= 0)
+        snd_seq_free_queue(seq, queue);
     snd_seq_close(seq);
+    seq = 0;
 }
 
 void AlsaSeqListener::Run()
@@ -364,7 +623,11 @@ void AlsaSeqListener::Run()
             if (err < 0)
                 break;
             if (event)
-                handle_alsa_event(midiclock->CurrentSamples() + MIDI_DELAY_FRAMES, event);
+            {
+                uint32_t now = midiclock->CurrentSamples();
+                handle_alsa_event(now + latency.Delay(), event);
+                latency.AddMargin(SamplesSignedDiff(midiqueue->RenderEnd(), now));
+            }
         } while (err > 0);
     }
 }
@@ -375,27 +638,43 @@ void AlsaSeqListener::Run()
 class SynthLoop: public AudioGenerator, public MIDIReceiver
 {
 public:
-    SynthLoop(Clock *midiclock, MidiEventQueue *midiqueue, unsigned int sample_rate, UI *ui):
+    SynthLoop(Clock *midiclock, MidiEventQueue *midiqueue, AlsaSeqListener *direct_input,
+              unsigned int sample_rate, UI *ui):
         midiclock(midiclock),
         midiqueue(midiqueue),
+        direct_input(direct_input),
         evh(sample_rate, ui),
         cur_samples(0),
+        reported_overflows(0),
         ui(ui)
     {
         evh.Reset();
+        evh.SetNumPorts(NumMIDIPorts);
     }
     ~SynthLoop() {}
 
     void PushEvent(uint32_t timestamp, int port, const unsigned char *data, unsigned length)
     {
-        midiqueue->PushEvent(cur_samples + timestamp, port, data, length);
+        midiqueue->PushEvent(cur_samples + timestamp, port, data, length, true);
     }
 
     void RequestSamples(unsigned long count, float* samples_out)
+    {
+        Render(count, samples_out, samples_out+1, 2);
+    }
+    void RequestSamplesPlanar(unsigned long count, float* left, float* right)
+    {
+        Render(count, left, right, 1);
+    }
+private:
+    void Render(unsigned long count, float* left, float* right, int step)
     {
         unsigned long offset = 0;
-        // Update adds in samples, so initialize to zero
-        memset(samples_out, 0, count*2*sizeof(float));
+        // Render adds in samples, so initialize to zero
+        for(unsigned long a = 0; a < count; ++a)
+            left[a*step] = right[a*step] = 0.0f;
+        if(direct_input)
+            direct_input->Poll(cur_samples, count);
         while(offset < count)
         {
             unsigned long n_samples = std::min(count - offset, (unsigned long)MaxSamplesAtTime);
@@ -407,13 +686,14 @@ public:
             } else {
                 //printf("current time %i, no next event\n", (int)cur_samples);
             }
-            evh.Update(&samples_out[offset*2], n_samples);
+            midiqueue->SetRenderEnd(cur_samples + n_samples);
+            evh.Render(left + offset*step, right + offset*step, step, n_samples);
 
             // Process events as long as they're either now or in the past
             while(midiqueue->PeekEvent(nextEventTime))
             {
                 if(SamplesSmallerThan(nextEventTime, cur_samples))
-                    ui->PrintLn("Warning: processing event in the past %i<%i\n", (int)nextEventTime, (int)cur_samples);
+                    midiqueue->CountLate();
                 uint32_t timeDiff = SamplesDiff(nextEventTime, cur_samples);
                 if(timeDiff > 0)
                     break;
@@ -423,12 +703,20 @@ public:
             cur_samples += n_samples;
         }
         midiclock->Sync(cur_samples);
+        unsigned overflows = midiqueue->Overflows();
+        if(overflows != reported_overflows)
+        {
+            ui->PrintLn("Warning: MIDI event queue full, %u events dropped", overflows - reported_overflows);
+            reported_overflows = overflows;
+        }
     }
-private:
+
     Clock *midiclock;
     MidiEventQueue *midiqueue;
+    AlsaSeqListener *direct_input; // Polled here if there is no listener thread
     MIDIeventhandler evh;
     uint32_t cur_samples;
+    unsigned reported_overflows;
     UI *ui;
 };
 
@@ -444,6 +732,7 @@ int main(int argc, char** argv)
 
     signal(SIGTERM, TidyupAndExit);
     signal(SIGINT, TidyupAndExit);
+    signal(SIGUSR1, RequestReport);
 
     int rv = ParseArguments(argc, argv);
     if(rv >= 0)
@@ -459,14 +748,46 @@ int main(int argc, char** argv)
     midiqueue = new MidiEventQueue();
 
     AlsaSeqListener *seqin = new AlsaSeqListener(midiclock, midiqueue);
-    seqin->Start();
+    if(DirectMIDIInput)
+        seqin->StartDirect(sample_rate);
+    else
+        seqin->Start();
 
-    SynthLoop audio_gen(midiclock, midiqueue, sample_rate, ui);
+    SynthLoop audio_gen(midiclock, midiqueue, DirectMIDIInput ? seqin : NULL, sample_rate, ui);
     StartAudio(&audio_gen, &audio_gen, ui);
 
     /// XXX use a condition flag
+    double reported_jitter = 0;
+    int reported_delay = 0;
+    unsigned reported_late = 0;
+    char summary[256];
     while(!QuitFlag)
+    {
         sleep(1);
+        if(ReportFlag)
+        {
+            ReportFlag = false;
+            AudioCallbackSummary(summary, sizeof(summary));
+            ui->PrintLn("%s", summary);
+        }
+        int delay = seqin->Delay();
+        unsigned late = midiqueue->LateEvents();
+        if((!DirectMIDIInput && abs(delay - reported_delay) > reported_delay / 10)
+        || late != reported_late)
+        {
+            ui->PrintLn("MIDI delay %.1f ms, %u late events", delay * 1000.0 / sample_rate, late);
+            reported_delay = delay;
+            reported_late = late;
+        }
+        // Report when the timing of the audio callbacks gets noticeably worse
+        double jitter = midiclock->Jitter();
+        if(jitter > reported_jitter * 1.25 + 16)
+        {
+            ui->PrintLn("MIDI clock: audio at %.1f Hz, jitter %.1f ms",
+                        midiclock->MeasuredRate(), jitter * 1000.0 / sample_rate);
+            reported_jitter = jitter;
+        }
+    }
 
     ShutdownAudio();
 
@@ -478,9 +799,12 @@ int main(int argc, char** argv)
     midiqueue = 0;
     delete ui;
     ui = 0;
+    AudioCallbackSummary(summary, sizeof(summary));
+    InitMessage(-1, "%s\n", summary);
 
     signal(SIGTERM, SIG_DFL);
     signal(SIGINT, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
     if(ExitSignal)
         raise(ExitSignal);
     return 0;
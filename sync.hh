@@ -22,5 +22,14 @@ public:
     void Signal() { SDL_CondSignal(cond); }
     void Wait(MutexType &mutex) { SDL_CondWait(cond, mutex.mut); }
 };
+class SemaphoreType
+{
+    SDL_sem* sem;
+public:
+    SemaphoreType(unsigned value = 0) : sem(SDL_CreateSemaphore(value)) { }
+    ~SemaphoreType() { SDL_DestroySemaphore(sem); }
+    void Post() { SDL_SemPost(sem); }
+    void Wait() { SDL_SemWait(sem); }
+};
 
 #endif
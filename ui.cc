@@ -1,12 +1,25 @@
 #include "ui.hh"
 
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <stdarg.h>
 #include <string>
+#include <sys/ioctl.h>
+#include <unistd.h>
 #include <vector>
 
 #include "adldata.hh"
 
+// Screen updates per second
+#define UI_FRAME_RATE 30
+// Screen height to assume when it is unknown
+#define DEFAULT_SCREEN_ROWS 55
+// Logged messages of one type shown per second, the rest are counted
+#define LOG_RATE_LIMIT 4
+
 static const char MIDIsymbols[256+1] =
 "PPPPPPhcckmvmxbd"  // Ins  0-15
 "oooooahoGGGGGGGG"  // Ins 16-31
@@ -27,6 +40,9 @@ static const char MIDIsymbols[256+1] =
 
 #include "midi_symbols_256.hh"
 
+/* Writes escape sequences to stderr. The output of a whole frame is
+ * collected in memory and written with a single write() on Flush.
+ */
 class UnixTerminalConsoleInterface: public ConsoleInterface
 {
 public:
@@ -34,22 +50,36 @@ public:
       x(0), y(0), color(-1),
       maxy(0), cursor_visible(true)
     {
-        std::memset(slots, '.',      sizeof(slots));
+        out.reserve(65536);
     }
 
     ~UnixTerminalConsoleInterface()
     {
         ShowCursor();
-        std::fputs("\33[0m", stderr);
-        std::fflush(stderr);
+        Put("\33[0m");
+        Flush();
     }
 
     void CreateGrid(int width, int height, int *out_width, int *out_height)
     {
-        std::fputc('\r', stderr); // Ensure cursor is at x=0
+        // Relative cursor movement only works within the screen. Stay off
+        // the last column too, where the cursor would wrap.
+        struct winsize ws;
+        if(ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1 && ws.ws_col > 1)
+        {
+            width = std::min(width, ws.ws_col - 1);
+            height = std::min(height, ws.ws_row - 1);
+        }
+        else
+            height = std::min(height, DEFAULT_SCREEN_ROWS - 1);
+        slots.Resize(width, height + 1, '.');
+        slotcolors.Resize(width, height + 1, -1); // Not drawn yet
+
+        Put('\r'); // Ensure cursor is at x=0
         GotoXY(0,0); Color(15);
-        std::fputs("Hit Ctrl-C to quit\r", stderr);
+        Put("Hit Ctrl-C to quit\r");
         HideCursor();
+        Flush();
 
         *out_width = width;
         *out_height = height;
@@ -57,34 +87,58 @@ public:
 
     void Draw(int notex,int notey, int color, char ch)
     {
-        if(slots[notex][notey] != ch
-        || slotcolors[notex][notey] != color)
+        if(slots(notex, notey) != ch
+        || slotcolors(notex, notey) != color)
         {
-            slots[notex][notey] = ch;
-            slotcolors[notex][notey] = color;
+            slots(notex, notey) = ch;
+            slotcolors(notex, notey) = color;
             GotoXY(notex, notey);
             Color(color);
-            std::fputc(ch, stderr);
+            Put(ch);
             ++x;
         }
     }
 
     void Flush()
     {
-        std::fflush(stderr);
+        const char *p = out.data();
+        size_t left = out.size();
+        while(left)
+        {
+            ssize_t n = write(STDERR_FILENO, p, left);
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                break;
+            }
+            p += n;
+            left -= n;
+        }
+        out.clear();
     }
 
 private:
     int x, y, color, maxy;
-    char slots[MaxWidth][MaxHeight];
-    unsigned char slotcolors[MaxWidth][MaxHeight];
+    Grid<char> slots;
+    Grid<short> slotcolors;
     bool cursor_visible;
+    std::string out; // Pending output
+
+    void Put(char c) { out += c; }
+    void Put(const char *s) { out += s; }
+    void Escape(const char *fmt, int n)
+    {
+        char buf[24];
+        int len = std::snprintf(buf, sizeof(buf), fmt, n);
+        out.append(buf, len);
+    }
 
     void HideCursor()
     {
         if(!cursor_visible) return;
         cursor_visible = false;
-        std::fputs("\33[?25l", stderr); // hide cursor
+        Put("\33[?25l"); // hide cursor
     }
 
     void ShowCursor()
@@ -92,8 +146,7 @@ private:
         if(cursor_visible) return;
         cursor_visible = true;
         GotoXY(0,maxy); Color(7);
-        std::fputs("\33[?25h", stderr); // show cursor
-        std::fflush(stderr);
+        Put("\33[?25h"); // show cursor
     }
 
     // Move tty cursor to the indicated position.
@@ -105,23 +158,38 @@ private:
         {
             while(newy > y)
             {
-                std::fputc('\n', stderr); y+=1; x=0;
+                Put('\n'); y+=1; x=0;
             }
         }
         if(newy > maxy)
             maxy = newy;
-        if(newy < y) { std::fprintf(stderr, "\33[%dA", y-newy); y = newy; }
-        if(newy > y) { std::fprintf(stderr, "\33[%dB", newy-y); y = newy; }
+        if(newy < y) { Escape("\33[%dA", y-newy); y = newy; }
+        if(newy > y) { Escape("\33[%dB", newy-y); y = newy; }
+        if(newx > x && newx-x <= 4 && Redraw(newx))
+            return;
         if(newx != x)
         {
             if(newx == 0 || (newx<10 && std::abs(newx-x)>=10))
-                { std::fputc('\r', stderr); x = 0; }
-            if(newx < x) std::fprintf(stderr, "\33[%dD", x-newx);
-            if(newx > x) std::fprintf(stderr, "\33[%dC", newx-x);
+                { Put('\r'); x = 0; }
+            if(newx < x) Escape("\33[%dD", x-newx);
+            if(newx > x) Escape("\33[%dC", newx-x);
             x = newx;
         }
     }
 
+    // Skip a short gap on the current line by printing what is already
+    // there, which is shorter than an escape sequence. Only possible when
+    // the gap was drawn before in the current color.
+    bool Redraw(int newx)
+    {
+        for(int tx = x; tx < newx; ++tx)
+            if(slotcolors(tx, y) != color)
+                return false;
+        for(; x < newx; ++x)
+            Put(slots(x, y));
+        return true;
+    }
+
     // Set color (4-bit or 8-bit). Bits: 1=blue, 2=green, 4=red, 8=+intensity
     void Color(int newcolor)
     {
@@ -130,11 +198,11 @@ private:
             if(newcolor<16)
             {
                 static const char map[16] = {0,17,2,6,1,5,3,7,24,12,10,14,9,13,11,15};
-                std::fprintf(stderr, "\33[0;38;5;%im", map[newcolor]);
+                Escape("\33[0;38;5;%im", map[newcolor]);
             }
             else
             {
-                std::fprintf(stderr, "\33[0;38;5;%im", newcolor);
+                Escape("\33[0;38;5;%im", newcolor);
             }
             color = newcolor;
         }
@@ -145,58 +213,182 @@ ConsoleInterface::~ConsoleInterface() {}
 
 UI::UI():
     width(0), height(0),
-    txtline(1)
+    txtline(1),
+    reported_overflows(0),
+    tap(0),
+    num_channel_levels(0),
+    running(true)
 {
-    std::memset(background, '.', sizeof(background));
-    std::memset(foreground, '.', sizeof(foreground));
+    std::memset(log_shown, 0, sizeof(log_shown));
+    std::memset(log_suppressed, 0, sizeof(log_suppressed));
+    log_window_start = SDL_GetTicks();
     console = new UnixTerminalConsoleInterface();
-    for(unsigned ch=0; ch<MaxHeight; ++ch)
-    {
-        curpatch[ch] = -1;
-        curins[ch] = -1;
-    }
 
-    int req_lines;
-    if(AdlPercussionMode)
-        req_lines = std::min(2u, NumCards) * 23;
-    else
-        req_lines = std::min(3u, NumCards) * 18;
-    console->CreateGrid(MaxWidth, req_lines, &width, &height);
+    // If not in percussion mode the lower 5 channels are not used, so use 18 lines per chip instead of 23
+    console->CreateGrid(MaxWidth, NumCards * (AdlPercussionMode ? 23 : 18), &width, &height);
+    background.Resize(width, height + 1, '.');
+    foreground.Resize(width, height + 1, '.');
+    cells.Resize(width, height + 1, ' ');
+    cellcolors.Resize(width, height + 1, 0);
+    dirty.Resize(width, height + 1, false);
+    curpatch.assign(MaxMIDIPorts * 16, -1);
+    curins.assign(MaxMIDIPorts * 16, -1);
+    thread = SDL_CreateThread(UIThread, this);
 }
 
 UI::~UI()
 {
+    running = false;
+    SDL_WaitThread(thread, NULL);
+    Update(); // Show whatever came in last
     delete console;
 }
+
+int UI::UIThread(void *param)
+{
+    UI *self = static_cast<UI*>(param);
+    while(self->running)
+    {
+        SDL_Delay(1000 / UI_FRAME_RATE);
+        self->Update();
+    }
+    return 0;
+}
+
+void UI::Update()
+{
+    for(Event *e; (e = events.Front()) != 0; events.Pop())
+    {
+        switch(e->type)
+        {
+        case Event::TEXT: DrawText(e->text); break;
+        case Event::NOTE: DrawNote(e->note); break;
+        case Event::PATCH: DrawPatchChange(e->patch); break;
+        case Event::LOG: DrawLog(e->log); break;
+        }
+    }
+    if(SDL_GetTicks() - log_window_start >= 1000)
+        ReportSuppressed();
+    tap_lock.Lock();
+    if(tap && analyzer.Update(tap))
+    {
+        DrawVolumes();
+        DrawSpectrum();
+    }
+    tap_lock.Unlock();
+    DrawChannelLevels();
+    if(dirty_cells.empty())
+        return;
+    // In screen order, so that runs of cells need no cursor movement
+    std::sort(dirty_cells.begin(), dirty_cells.end());
+    for(size_t i = 0; i < dirty_cells.size(); ++i)
+    {
+        int x = dirty_cells[i] % width, y = dirty_cells[i] / width;
+        dirty(x, y) = false;
+        console->Draw(x, y, cellcolors(x, y), cells(x, y));
+    }
+    dirty_cells.clear();
+    console->Flush();
+}
+
+// Only the last state of a cell within a frame reaches the console
+void UI::Put(int x, int y, int color, char ch)
+{
+    if(x >= width || y > height)
+        return; // Off screen
+    if(!dirty(x, y))
+    {
+        dirty(x, y) = true;
+        dirty_cells.push_back(y * width + x);
+    }
+    cells(x, y) = ch;
+    cellcolors(x, y) = color;
+}
+
 void UI::PrintLn(const char* fmt, ...)
 {
+    Event e;
+    e.type = Event::TEXT;
     va_list ap;
     va_start(ap, fmt);
-    char Line[512];
-    int nchars = vsnprintf(Line, sizeof(Line), fmt, ap);
+    int nchars = vsnprintf(e.text, sizeof(e.text), fmt, ap);
     va_end(ap);
 
     if(nchars <= 0) return;
-    if((size_t)nchars > (sizeof(Line)-1))
-        nchars = sizeof(Line)-1;
+    events.Push(e);
+}
 
-    const int beginx = 2;
+void UI::Log(LogMessage msg, int a, int b, int c, int d, const char *text)
+{
+    Event e;
+    e.type = Event::LOG;
+    LogEvent l = {msg, {a, b, c, d}, text};
+    e.log = l;
+    events.Push(e);
+}
+
+void UI::DrawLog(const LogEvent &e)
+{
+    if(log_shown[e.msg] >= LOG_RATE_LIMIT)
+    {
+        ++log_suppressed[e.msg];
+        log_last_suppressed[e.msg] = e;
+        return;
+    }
+    ++log_shown[e.msg];
+    char line[80];
+    if(FormatLogMessage(line, sizeof(line), e.msg, e.args, e.text) > 0)
+        DrawText(line);
+}
+
+// Called every second: summarize what the rate limit and a full queue dropped
+void UI::ReportSuppressed()
+{
+    for(unsigned msg = 0; msg < NumLogMessages; ++msg)
+    {
+        if(log_suppressed[msg])
+        {
+            const LogEvent &e = log_last_suppressed[msg];
+            char line[80];
+            int n = FormatLogMessage(line, sizeof(line), e.msg, e.args, e.text);
+            if(n >= 0 && (unsigned)n < sizeof(line))
+                std::snprintf(line + n, sizeof(line) - n, " (+%u more)", log_suppressed[msg] - 1);
+            DrawText(line);
+        }
+        log_shown[msg] = 0;
+        log_suppressed[msg] = 0;
+    }
+    unsigned overflows = events.Overflows();
+    if(overflows != reported_overflows)
+    {
+        char line[80];
+        std::snprintf(line, sizeof(line), "UI queue full, %u events dropped", overflows - reported_overflows);
+        DrawText(line);
+        reported_overflows = overflows;
+    }
+    log_window_start = SDL_GetTicks();
+}
+
+void UI::DrawText(const char *Line)
+{
+    const int beginx = 2, endx = std::min(80, width);
     int x;
-    for(x=beginx; x-beginx<nchars && x < 80; ++x)
+    for(x=beginx; Line[x-beginx] && x < endx; ++x)
     {
         if(Line[x-beginx] == '\n') break;
-        console->Draw(x, txtline, Line[x-beginx] == '.' ? 1 : 8, background[x][txtline] = Line[x-beginx]);
+        Put(x, txtline, Line[x-beginx] == '.' ? 1 : 8, background(x, txtline) = Line[x-beginx]);
     }
-    for(int tx=x; tx<80; ++tx)
+    for(int tx=x; tx<endx; ++tx)
     {
-        if(background[tx][txtline]!='.' && foreground[tx][txtline]=='.')
+        if(background(tx, txtline)!='.' && foreground(tx, txtline)=='.')
         {
-            console->Draw(tx, txtline, 1, background[tx][txtline] = '.');
+            Put(tx, txtline, 1, background(tx, txtline) = '.');
             ++x;
         }
     }
 
-    txtline=(1 + txtline) % height;
+    // Row 0 is kept for the spectrum
+    txtline = 1 + txtline % height;
 }
 
 void InitMessage(int color, const char *fmt, ...)
@@ -216,12 +408,22 @@ void InitMessage(int color, const char *fmt, ...)
 
 void UI::IllustrateNote(int adlchn, int note, int ins, int pressure, double bend)
 {
-    // If not in percussion mode the lower 5 channels are not use, so use 18 lines per chip instead of 23
-    if(!AdlPercussionMode)
-        adlchn = (adlchn / 23) * 18 + (adlchn % 23);
+    Event e;
+    e.type = Event::NOTE;
+    NoteEvent n = {adlchn, note, ins, pressure, bend};
+    e.note = n;
+    events.Push(e);
+}
+
+void UI::DrawNote(const NoteEvent &e)
+{
+    const int note = e.note, ins = e.ins, pressure = e.pressure;
+    const double bend = e.bend;
     int notex = 2 + (note+55)%77;
-    int notey = 1 + adlchn % height;
-    char illustrate_char = background[notex][notey];
+    if(notex >= width)
+        return;
+    int notey = ChannelRow(e.adlchn);
+    char illustrate_char = background(notex, notey);
     if(pressure > 0)
     {
         illustrate_char = MIDIsymbols[ins];
@@ -232,66 +434,167 @@ void UI::IllustrateNote(int adlchn, int note, int ins, int pressure, double bend
     {
         illustrate_char = '%';
     }
-    console->Draw(notex,notey,
+    Put(notex,notey,
         pressure?AllocateColor(ins):
         (illustrate_char=='.'?1:
          illustrate_char=='&'?1: 8),
         illustrate_char);
-    console->Flush();
-    foreground[notex][notey] = illustrate_char;
+    foreground(notex, notey) = illustrate_char;
+}
+
+void UI::AttachAudioTap(AudioTap *new_tap)
+{
+    tap_lock.Lock();
+    tap = new_tap;
+    tap_lock.Unlock();
 }
 
-void UI::IllustrateVolumes(double left, double right)
+// Convert a level (full scale 1) to the height of a volume bar (0..1)
+static double VolumeBar(double level)
+{
+    level *= 32767;
+    const double dB = std::log(level<1 ? 1 : level) * 4.328085123;
+    const double maxdB = 3*16; // = 3 * log2(65536)
+    return dB/maxdB;
+}
+
+void UI::DrawVolumes()
 {
     const unsigned maxy = height;
     const unsigned white_threshold  = maxy/23;
     const unsigned red_threshold    = maxy*4/23;
     const unsigned yellow_threshold = maxy*8/23;
 
-    double amp[2] = {left*maxy, right*maxy};
+    double amp[2], peak[2];
+    for(unsigned w=0; w<2; ++w)
+    {
+        amp[w] = VolumeBar(analyzer.rms[w]) * maxy;
+        peak[w] = VolumeBar(analyzer.peak[w]) * maxy;
+    }
     for(unsigned y=0; y<maxy; ++y)
         for(unsigned w=0; w<2; ++w)
         {
-            char c = amp[w] > (maxy-1)-y ? '|' : background[w][y+1];
-            console->Draw(w,y+1,
-                 c=='|' ? y<white_threshold ? 15
+            // The bar shows the RMS level, a '-' on top of it the peak
+            char c = amp[w] > (maxy-1)-y ? '|'
+                   : peak[w] > (maxy-1)-y && peak[w] <= maxy-y ? '-'
+                   : background(w, y+1);
+            Put(w,y+1,
+                 c=='|' || c=='-' ? y<white_threshold ? 15
                         : y<red_threshold ? 12
                         : y<yellow_threshold ? 14
                         : 10 : (c=='.' ? 1 : 8),
                  c);
         }
-    console->Flush();
+}
+
+void UI::DrawSpectrum()
+{
+    // One column per band on the top row, from -60 dB to full scale
+    static const char shades[] = " .:-=+*#%@";
+    const int beginx = 2, endx = std::min(80, width);
+    if(endx <= beginx)
+        return;
+    float bands[80];
+    analyzer.Spectrum(bands, endx - beginx);
+    for(int x = beginx; x < endx; ++x)
+    {
+        const float dB = bands[x - beginx];
+        int shade = (int)((dB + 60) * (sizeof(shades) - 1) / 60);
+        shade = std::max(0, std::min(shade, (int)sizeof(shades) - 2));
+        Put(x, 0, dB > -6 ? 12 : dB > -20 ? 14 : 10, shades[shade]);
+    }
+}
+
+int UI::ChannelRow(int adlchn) const
+{
+    // If not in percussion mode the lower 5 channels are not use, so use 18 lines per chip instead of 23
+    if(!AdlPercussionMode)
+        adlchn = (adlchn / 23) * 18 + (adlchn % 23);
+    // Not stored at construction, -a may add cards after the grid is made
+    const int channel_rows = NumCards * (AdlPercussionMode ? 23 : 18);
+    // When the screen is too small, neighbouring channels share a line
+    return 1 + (channel_rows <= height ? adlchn : adlchn * height / channel_rows) % height;
+}
+
+void UI::IllustrateChannelLevels(const float *levels, unsigned count)
+{
+    count = std::min(count, MaxCards * 23);
+    for(unsigned c = 0; c < count; ++c)
+        channel_levels[c].store(levels[c], std::memory_order_relaxed);
+    num_channel_levels.store(count, std::memory_order_relaxed);
+}
+
+void UI::DrawChannelLevels()
+{
+    // One column right of the notes, the loudest channel of each row
+    static const char shades[] = " .:-=+*#%@";
+    const int x = 79;
+    const unsigned count = num_channel_levels.load(std::memory_order_relaxed);
+    if(!count || x >= width)
+        return;
+    std::vector<float> rows(height + 1, 0.0f);
+    for(unsigned c = 0; c < count; ++c)
+    {
+        if(!AdlPercussionMode && c % 23 >= 18)
+            continue;
+        float &level = rows[ChannelRow(c)];
+        level = std::max(level, channel_levels[c].load(std::memory_order_relaxed));
+    }
+    for(int y = 1; y <= height; ++y)
+    {
+        const double amp = VolumeBar(rows[y]);
+        const int shade = std::max(0, std::min((int)(amp * (sizeof(shades) - 1)), (int)sizeof(shades) - 2));
+        char c = shade ? shades[shade] : background(x, y);
+        int color = shade ? (amp > 0.9 ? 12 : amp > 0.7 ? 14 : 10) : (c == '.' ? 1 : 8);
+        if(cells(x, y) != c || cellcolors(x, y) != color)
+            Put(x, y, color, c);
+    }
 }
 
 void UI::IllustratePatchChange(int MidCh, int patch, int adlinsid)
 {
-    if(MidCh < 0 || MidCh >= height || (patch != -1 && curpatch[MidCh] == patch && curins[MidCh] == adlinsid))
+    Event e;
+    e.type = Event::PATCH;
+    PatchEvent c = {MidCh, patch, adlinsid};
+    e.patch = c;
+    events.Push(e);
+}
+
+void UI::DrawPatchChange(const PatchEvent &e)
+{
+    const int MidCh = e.MidCh, patch = e.patch, adlinsid = e.adlinsid;
+    if(MidCh < 0 || MidCh >= (int)curpatch.size() || (patch != -1 && curpatch[MidCh] == patch && curins[MidCh] == adlinsid))
         return;
     curpatch[MidCh] = patch;
     curins[MidCh] = adlinsid;
+    if(MidCh >= height)
+    {
+        DrawHiddenPatches();
+        return;
+    }
     // 8 or 9 or 11
-    console->Draw(81,MidCh+1, 8, '0' + (MidCh / 10));
-    console->Draw(82,MidCh+1, 8, '0' + (MidCh % 10));
+    Put(81,MidCh+1, 8, '0' + (MidCh / 10));
+    Put(82,MidCh+1, 8, '0' + (MidCh % 10));
     const int name_column = 92;
     if(patch == -1)
     {
-        console->Draw(84,MidCh+1, 1, '-');
-        console->Draw(85,MidCh+1, 1, '-');
-        console->Draw(86,MidCh+1, 1, '-');
-        console->Draw(88,MidCh+1, 1, '-');
-        console->Draw(89,MidCh+1, 1, '-');
-        console->Draw(90,MidCh+1, 1, '-');
+        Put(84,MidCh+1, 1, '-');
+        Put(85,MidCh+1, 1, '-');
+        Put(86,MidCh+1, 1, '-');
+        Put(88,MidCh+1, 1, '-');
+        Put(89,MidCh+1, 1, '-');
+        Put(90,MidCh+1, 1, '-');
         for(unsigned x=name_column; x<MaxWidth; ++x)
-            console->Draw(x,MidCh+1, 1, ' ');
+            Put(x,MidCh+1, 1, ' ');
     }
     else
     {
-        console->Draw(84,MidCh+1, 8, '0' + ((patch/100) % 10));
-        console->Draw(85,MidCh+1, 8, '0' + ((patch/10) % 10));
-        console->Draw(86,MidCh+1, 8, '0' + ((patch) % 10));
-        console->Draw(88,MidCh+1, 1, '[');
-        console->Draw(89,MidCh+1, AllocateColor(patch), MIDIsymbols[patch]);
-        console->Draw(90,MidCh+1, 1, ']');
+        Put(84,MidCh+1, 8, '0' + ((patch/100) % 10));
+        Put(85,MidCh+1, 8, '0' + ((patch/10) % 10));
+        Put(86,MidCh+1, 8, '0' + ((patch) % 10));
+        Put(88,MidCh+1, 1, '[');
+        Put(89,MidCh+1, AllocateColor(patch), MIDIsymbols[patch]);
+        Put(90,MidCh+1, 1, ']');
         std::string name = "[unnamed]";
         int color = 1;
         if(adlinsid >= 0)
@@ -313,12 +616,25 @@ void UI::IllustratePatchChange(int MidCh, int patch, int adlinsid)
         for(unsigned x=name_column; x<MaxWidth-1; ++x)
         {
             if((x-name_column) < name.size())
-                console->Draw(x,MidCh+1, color, name[x-name_column]);
+                Put(x,MidCh+1, color, name[x-name_column]);
             else
-                console->Draw(x,MidCh+1, color, ' ');
+                Put(x,MidCh+1, color, ' ');
         }
     }
-    console->Flush();
+}
+
+// The channels that have no row left are counted above the patch list
+void UI::DrawHiddenPatches()
+{
+    unsigned hidden = 0;
+    for(size_t c = height; c < curpatch.size(); ++c)
+        if(curpatch[c] != -1)
+            ++hidden;
+    char text[24] = "";
+    if(hidden)
+        std::snprintf(text, sizeof(text), "+%u more channels", hidden);
+    for(unsigned x = 81, i = 0; x < MaxWidth - 1; ++x)
+        Put(x, 0, 8, text[i] ? text[i++] : ' ');
 }
 
 // Choose a permanent color for given instrument
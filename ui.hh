@@ -1,16 +1,42 @@
 #ifndef H_UI
 #define H_UI
 
+#include "audiotap.hh"
 #include "config.hh"
+#include "ringbuffer.hh"
+#include "sync.hh"
 #include "uiinterface.hh"
 
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/* Two-dimensional array sized at run time, indexed as (x, y) */
+template<typename T>
+class Grid
+{
+public:
+    Grid(): width(0) { }
+    void Resize(int new_width, int new_height, const T &value)
+    {
+        width = new_width;
+        data.assign((size_t)new_width * new_height, value);
+    }
+    T &operator()(int x, int y) { return data[(size_t)y * width + x]; }
+    const T &operator()(int x, int y) const { return data[(size_t)y * width + x]; }
+private:
+    std::vector<T> data; // Row by row
+    int width;
+};
+
 /* Console backend */
 class ConsoleInterface
 {
 public:
     virtual ~ConsoleInterface() = 0;
     /* Create the grid. Requests a certain width and height, and returns
-     * the actual width and height.
+     * the actual width and height, which may be smaller to fit the screen.
+     * Rows 0 to height are drawn to, row 0 holds the status line.
      */
     virtual void CreateGrid(int width, int height, int *out_width, int *out_height) = 0;
     /* Draw an arbitrary character in an arbitrary position */
@@ -19,18 +45,79 @@ public:
     virtual void Flush() = 0;
 };
 
+/* Terminal UI. The Illustrate and PrintLn calls only queue an event, so
+ * they are safe to call from the audio thread. A separate thread applies
+ * the events at a fixed frame rate and draws all cells that changed
+ * during the frame at once.
+ */
 class UI: public UIInterface
 {
 private:
+    struct NoteEvent { int adlchn, note, ins, pressure; double bend; };
+    struct PatchEvent { int MidCh, patch, adlinsid; };
+    struct LogEvent { int msg; int args[4]; const char *text; };
+    struct Event
+    {
+        enum { TEXT, NOTE, PATCH, LOG } type;
+        union
+        {
+            NoteEvent note;
+            PatchEvent patch;
+            LogEvent log;
+            char text[80]; // Only this much of a line fits on the screen
+        };
+    };
+
     ConsoleInterface *console;
 
     int width, height;
     int txtline;
-    char background[MaxWidth][MaxHeight];
-    char foreground[MaxWidth][MaxHeight];
-    short curpatch[MaxHeight];
-    short curins[MaxHeight];
+    Grid<char> background;
+    Grid<char> foreground;
+    std::vector<short> curpatch;
+    std::vector<short> curins;
+
+    // Screen contents after the events of this frame, and what changed
+    Grid<char> cells;
+    Grid<unsigned char> cellcolors;
+    Grid<char> dirty;
+    std::vector<unsigned> dirty_cells;
+
+    MultiProducerRingBuffer<Event, 4096> events;
+    unsigned reported_overflows;
+
+    // Logged messages shown and suppressed in the current second, per type
+    Uint32 log_window_start;
+    unsigned log_shown[NumLogMessages];
+    unsigned log_suppressed[NumLogMessages];
+    LogEvent log_last_suppressed[NumLogMessages];
+    // Output levels and spectrum, analyzed on the UI thread
+    MutexType tap_lock;
+    AudioTap *tap;
+    AudioAnalyzer analyzer;
+
+    // Stored by the synthesizer, drawn next to the notes of each channel
+    std::atomic<float> channel_levels[MaxCards * 23];
+    std::atomic<unsigned> num_channel_levels;
+
+    SDL_Thread *thread;
+    std::atomic<bool> running;
 
+    static int UIThread(void *param);
+    // Apply all queued events and draw the result
+    void Update();
+    void Put(int x, int y, int color, char ch);
+    void DrawText(const char *line);
+    void DrawNote(const NoteEvent &e);
+    void DrawVolumes();
+    void DrawSpectrum();
+    void DrawChannelLevels();
+    // Screen row of an OPL channel
+    int ChannelRow(int adlchn) const;
+    void DrawPatchChange(const PatchEvent &e);
+    void DrawHiddenPatches();
+    void DrawLog(const LogEvent &e);
+    void ReportSuppressed();
     // Choose a permanent color for given instrument
     int AllocateColor(int ins);
 public:
@@ -38,8 +125,10 @@ public:
     ~UI();
     void PrintLn(const char* fmt, ...) __attribute__((format(printf,2,3)));
     void IllustrateNote(int adlchn, int note, int ins, int pressure, double bend);
-    void IllustrateVolumes(double left, double right);
     void IllustratePatchChange(int MidCh, int patch, int adlinsid);
+    void Log(LogMessage msg, int a = 0, int b = 0, int c = 0, int d = 0, const char *text = 0);
+    void AttachAudioTap(AudioTap *tap);
+    void IllustrateChannelLevels(const float *levels, unsigned count);
 };
 
 void InitMessage(int color, const char *fmt, ...) __attribute__((format(printf,2,3)));
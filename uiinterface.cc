@@ -1,4 +1,46 @@
 #include "uiinterface.hh"
 
+#include <cstdio>
+
+static const char *const log_formats[NumLogMessages] =
+{
+    "Ctrl %d <- %d (ch %u)",
+    "RPN %04X <- %d (%cSB) (ch %u)",
+    "NRPN %04X <- %d (%cSB) (ch %u)",
+    "Portamento %u: %u (unimplemented)",
+    "SysEx %02X: %u bytes",
+    "[%u]Bank %u undefined",
+    "[%u]Bank lsb %u undefined",
+    "[%u] Using bank %d",
+    "[%u] Using undefined bank %d",
+    "[%i]Playing missing instrument %i",
+};
+
+int FormatLogMessage(char *buf, unsigned size, int msg, const int args[4], const char *text)
+{
+    if(msg < 0 || msg >= NumLogMessages)
+        return std::snprintf(buf, size, "Unknown message %d", msg);
+    // Every format takes at most four integer arguments
+    int n = std::snprintf(buf, size, log_formats[msg], args[0], args[1], args[2], args[3]);
+    if(text && n >= 0 && (unsigned)n < size)
+        n += std::snprintf(buf + n, size - n, " '%s'", text);
+    return n;
+}
+
 UIInterface::~UIInterface() { }
 
+void UIInterface::Log(LogMessage msg, int a, int b, int c, int d, const char *text)
+{
+    const int args[4] = {a, b, c, d};
+    char line[256];
+    if(FormatLogMessage(line, sizeof(line), msg, args, text) > 0)
+        PrintLn("%s", line);
+}
+
+void UIInterface::AttachAudioTap(AudioTap *)
+{
+}
+
+void UIInterface::IllustrateChannelLevels(const float *, unsigned)
+{
+}
@@ -1,6 +1,27 @@
 #ifndef H_UIINTERFACE
 #define H_UIINTERFACE
 
+class AudioTap;
+
+/* Messages that can be logged from the real-time path, see UIInterface::Log */
+enum LogMessage
+{
+    LOG_CONTROLLER,         // controller, value, channel
+    LOG_RPN,                // address, value, 'L' or 'M', channel
+    LOG_NRPN,               // address, value, 'L' or 'M', channel
+    LOG_PORTAMENTO,         // channel, portamento
+    LOG_SYSEX,              // first byte, length
+    LOG_BANK_UNDEFINED,     // channel, bank MSB
+    LOG_BANK_LSB_UNDEFINED, // channel, bank LSB
+    LOG_USING_BANK,         // channel, bank, with the bank name as text
+    LOG_USING_UNDEFINED_BANK, // channel, bank
+    LOG_MISSING_INSTRUMENT, // channel, instrument
+    NumLogMessages
+};
+
+/* Format a logged message into buf, returns the length like snprintf */
+int FormatLogMessage(char *buf, unsigned size, int msg, const int args[4], const char *text);
+
 /* UI interface */
 class UIInterface
 {
@@ -9,8 +30,23 @@ public:
 
     virtual void PrintLn(const char* fmt, ...) __attribute__((format(printf,2,3))) = 0;
     virtual void IllustrateNote(int adlchn, int note, int ins, int pressure, double bend) = 0;
-    virtual void IllustrateVolumes(double left, double right) = 0;
     virtual void IllustratePatchChange(int MidCh, int patch, int adlinsid) = 0;
+    /* Log one of the predefined messages. Only the message type, up to
+     * four integers and an optional string with static lifetime are
+     * passed, so an implementation can defer the formatting. The default
+     * formats the message right away and passes it to PrintLn.
+     */
+    virtual void Log(LogMessage msg, int a = 0, int b = 0, int c = 0, int d = 0, const char *text = 0);
+    /* Start (or with 0, stop) reading the output levels and spectrum from
+     * tap. The analysis is up to the UI, on a thread of its own; the
+     * default ignores the tap.
+     */
+    virtual void AttachAudioTap(AudioTap *tap);
+    /* Measured output level of every OPL channel, full scale 1, numbered
+     * like in IllustrateNote. Only with -meters, from the audio thread, a
+     * few dozen times per second. The default ignores them.
+     */
+    virtual void IllustrateChannelLevels(const float *levels, unsigned count);
 };
 
 #endif